@@ -0,0 +1,62 @@
+//
+//  batch_bench.cpp
+//
+//  Aggregate decode speed of concurrent streams on the scheduler.
+//
+
+#include "llm.hpp"
+#include "scheduler.hpp"
+#include "prompts.hpp"
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <stdlib.h>
+
+int main(int argc, const char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " config.json prompt.txt [streams = 8,16,32] [max_new_tokens = 128]" << std::endl;
+        return 0;
+    }
+    std::string model_dir = argv[1];
+    auto prompts = read_prompts(argv[2]);
+    if (prompts.empty()) {
+        std::cout << "no prompt in " << argv[2] << std::endl;
+        return 0;
+    }
+    std::vector<int> streams;
+    std::istringstream stream_str(argc > 3 ? argv[3] : "8,16,32");
+    for (std::string num; std::getline(stream_str, num, ',');) {
+        streams.push_back(atoi(num.c_str()));
+    }
+    int max_new_tokens = argc > 4 ? atoi(argv[4]) : 128;
+    std::unique_ptr<Llm> llm(Llm::createLLM(model_dir));
+    llm->load();
+    struct Result {
+        int streams;
+        bool batched;
+        Scheduler::Stats stats;
+        double seconds;
+    };
+    std::vector<Result> results;
+    for (auto stream_num : streams) {
+        Scheduler scheduler(llm.get(), stream_num);
+        for (int i = 0; i < stream_num; i++) {
+            scheduler.submit(prompts[i % prompts.size()], max_new_tokens);
+        }
+        auto st = std::chrono::steady_clock::now();
+        scheduler.run_until_idle();
+        auto et = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(et - st).count() / 1e6;
+        results.push_back({stream_num, scheduler.batched(), scheduler.stats(), seconds});
+    }
+    printf("\n#################################\n");
+    printf("streams | mode    | steps | prefill tok | decode tok | decode tok/s | total tok/s\n");
+    for (auto& r : results) {
+        printf("%7d | %-7s | %5ld | %11ld | %10ld | %12.2f | %11.2f\n", r.streams, r.batched ? "batched" : "rr",
+               static_cast<long>(r.stats.steps), static_cast<long>(r.stats.prefill_tokens),
+               static_cast<long>(r.stats.decode_tokens), r.stats.decode_tokens / (r.stats.decode_us / 1e6),
+               (r.stats.prefill_tokens + r.stats.decode_tokens) / r.seconds);
+    }
+    printf("##################################\n");
+    return 0;
+}
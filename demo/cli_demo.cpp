@@ -6,6 +6,7 @@
 //
 
 #include "llm.hpp"
+#include "prompts.hpp"
 #include <fstream>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -13,21 +14,7 @@
 
 void benchmark(Llm* llm, std::string prompt_file) {
     std::cout << "prompt file is " << prompt_file << std::endl;
-    std::ifstream prompt_fs(prompt_file);
-    std::vector<std::string> prompts;
-    std::string prompt;
-    while (std::getline(prompt_fs, prompt)) {
-        // prompt start with '#' will be ignored
-        if (prompt.substr(0, 1) == "#") {
-            continue;
-        }
-        std::string::size_type pos = 0;
-        while ((pos = prompt.find("\\n", pos)) != std::string::npos) {
-            prompt.replace(pos, 2, "\n");
-            pos += 1;
-        }
-        prompts.push_back(prompt);
-    }
+    auto prompts = read_prompts(prompt_file);
     int prompt_len = 0;
     int decode_len = 0;
     int64_t prefill_time = 0;
@@ -121,6 +108,11 @@ int main(int argc, const char* argv[]) {
     } else if (argc == 3){
         std::string prompt_file = argv[2];
         benchmark(llm.get(), prompt_file);
+        llm->print_profile();
+        if (llm->tracer().enabled()) {
+            llm->tracer().save("llm_trace.json");
+            printf("timing trace is saved to llm_trace.json\n");
+        }
     } else {
         evaluate(llm.get(), argv[2], atoi(argv[3]));
     }
@@ -0,0 +1,205 @@
+//
+//  host_bench.cpp
+//
+//  Host side hot paths on a synthetic model: no kmodel and no NPU, embedding, mask, position ids,
+//  sample and tokenizer are timed in isolation.
+//
+
+#include "llm.hpp"
+#include "llmconfig.hpp"
+#include "mock_model.hpp"
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+// exposes the protected host stages of Llm, only tokenizer and embedding are loaded
+class HostBench : public Llm {
+public:
+    HostBench(std::shared_ptr<LlmConfig> config) : Llm(config) {}
+    void setup() {
+        init_runtime();
+        init_status();
+        load_tokenizer();
+        load_embedding();
+    }
+    void set_context(int all_seq_len) {
+        all_seq_len_ = all_seq_len;
+        gen_seq_len_ = 1;
+    }
+    using Llm::embedding;
+    using Llm::gen_attention_mask;
+    using Llm::gen_position_ids;
+};
+
+struct Stage {
+    std::string name;
+    std::vector<int64_t> ns;
+};
+
+template <typename Func>
+static Stage measure(const std::string& name, int iterations, Func&& func) {
+    Stage stage {name, {}};
+    // one untimed call pages in tables and warms the allocator
+    func();
+    for (int i = 0; i < iterations; i++) {
+        auto st = Clock::now();
+        func();
+        stage.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - st).count());
+    }
+    std::sort(stage.ns.begin(), stage.ns.end());
+    return stage;
+}
+
+static double percentile_us(const Stage& stage, double p) {
+    size_t rank = static_cast<size_t>(p / 100 * stage.ns.size() + 0.5);
+    return stage.ns[std::min(std::max<size_t>(rank, 1), stage.ns.size()) - 1] / 1e3;
+}
+
+static double mean_us(const Stage& stage) {
+    double sum = 0;
+    for (auto ns : stage.ns) {
+        sum += ns;
+    }
+    return sum / stage.ns.size() / 1e3;
+}
+
+static const char* arch_name() {
+#if defined(__x86_64__)
+    return "x86_64";
+#elif defined(__riscv)
+    return "riscv64";
+#elif defined(__aarch64__)
+    return "aarch64";
+#else
+    return "unknown";
+#endif
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "-h") {
+        std::cout << "Usage: " << argv[0] << " [vocab = 32000] [hidden = 1024] [context = 1024] [iterations = 1000]"
+                  << " [output.json]" << std::endl;
+        return 0;
+    }
+    int vocab_size = argc > 1 ? atoi(argv[1]) : 32000;
+    int hidden_size = argc > 2 ? atoi(argv[2]) : 1024;
+    int context = argc > 3 ? atoi(argv[3]) : 1024;
+    int iterations = std::max(argc > 4 ? atoi(argv[4]) : 1000, 1);
+    std::string output = argc > 5 ? argv[5] : "";
+    vocab_size = std::max(vocab_size, 512);
+    // synthetic model directory: generated tokenizer and a sparse bf16 embedding table
+    char dir_template[] = "/tmp/host_bench.XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        printf("Failed: can't create a temp directory\n");
+        return 1;
+    }
+    std::string dir = dir_template;
+    write_tokenizer(dir + "/tokenizer.txt", vocab_size);
+    {
+        std::ofstream ofs(dir + "/embeddings_bf16.bin", std::ios::binary);
+    }
+    if (truncate((dir + "/embeddings_bf16.bin").c_str(), static_cast<off_t>(vocab_size) * hidden_size * 2) != 0) {
+        printf("Failed: can't size the embedding file\n");
+        return 1;
+    }
+    std::shared_ptr<LlmConfig> config(new LlmConfig());
+    config->base_dir_ = dir + "/";
+    // tensors are plain host memory, the numbers don't depend on the runtime of the build
+    config->config_ = {{"backend_type", "mock"}, {"temperature", 0.f}, {"seed", 0}, {"top_k", 40}, {"top_p", 0.9f}};
+    config->llm_config_ = {
+        {"hidden_size", hidden_size},
+        {"layer_nums", 1},
+        // [2, kv heads, seq, head dim], only the seq capacity matters on host
+        {"key_value_shape", {2, 1, context, 64}},
+        {"kv_seq_axis", 2},
+        {"attention_mask", "int"}
+    };
+    HostBench llm(config);
+    llm.setup();
+    // fixed inputs
+    std::mt19937 rng(0);
+    std::vector<int> prompt(std::min(context / 2, 512));
+    for (auto& id : prompt) {
+        id = rng() % vocab_size;
+    }
+    std::vector<float> logits(vocab_size);
+    std::normal_distribution<float> dist(0.f, 4.f);
+    for (auto& score : logits) {
+        score = dist(rng);
+    }
+    std::vector<int> history(prompt.begin(), prompt.begin() + std::min<size_t>(prompt.size(), 256));
+    const std::string text = "The quick brown fox jumps over the lazy dog while the kv cache grows token by token.";
+    int decode_pos = context - 2;
+    std::vector<Stage> stages;
+    // decode path, one token at the end of a nearly full context
+    llm.set_context(decode_pos);
+    stages.push_back(measure("embedding_1", iterations, [&]() { llm.embedding({prompt[0]}); }));
+    stages.push_back(measure("mask_1", iterations, [&]() { llm.gen_attention_mask(1, true); }));
+    stages.push_back(measure("position_1", iterations, [&]() { llm.gen_position_ids(1, true); }));
+    stages.push_back(measure("sample_greedy", iterations, [&]() { llm.sample(logits.data(), vocab_size, history); }));
+    llm.set_config(R"({"temperature": 0.8})");
+    stages.push_back(measure("sample_topk_topp", iterations, [&]() { llm.sample(logits.data(), vocab_size, history); }));
+    llm.set_config(R"({"temperature": 0})");
+    std::string out;
+    int next = 0;
+    stages.push_back(measure("detokenize", iterations, [&]() {
+        out.clear();
+        llm.decode(prompt[next++ % prompt.size()], out);
+    }));
+    // prefill path, the whole prompt from an empty context
+    llm.set_context(0);
+    int prefill_iterations = std::max(iterations / 10, 1);
+    auto prefill_suffix = "_" + std::to_string(prompt.size());
+    stages.push_back(measure("embedding" + prefill_suffix, prefill_iterations, [&]() { llm.embedding(prompt); }));
+    stages.push_back(measure("mask" + prefill_suffix, prefill_iterations, [&]() {
+        llm.gen_attention_mask(static_cast<int>(prompt.size()), false);
+    }));
+    stages.push_back(measure("position" + prefill_suffix, prefill_iterations, [&]() {
+        llm.gen_position_ids(static_cast<int>(prompt.size()), false);
+    }));
+    stages.push_back(measure("tokenize", prefill_iterations, [&]() { llm.encode(text); }));
+    // host budget of one decode token: everything but the module invoke
+    double per_token_us = 0;
+    for (auto& stage : stages) {
+        if (stage.name == "embedding_1" || stage.name == "mask_1" || stage.name == "position_1" ||
+            stage.name == "sample_greedy" || stage.name == "detokenize") {
+            per_token_us += mean_us(stage);
+        }
+    }
+    printf("\n#################################\n");
+    printf("arch = %s, vocab = %d, hidden = %d, context = %d\n", arch_name(), vocab_size, hidden_size, context);
+    printf("stage              |    mean us |     p50 us |     p99 us\n");
+    json report = {
+        {"arch", arch_name()},
+        {"vocab_size", vocab_size},
+        {"hidden_size", hidden_size},
+        {"context", context},
+        {"iterations", iterations},
+        {"stages", json::array()}
+    };
+    for (auto& stage : stages) {
+        printf("%-18s | %10.2f | %10.2f | %10.2f\n", stage.name.c_str(), mean_us(stage),
+               percentile_us(stage, 50), percentile_us(stage, 99));
+        report["stages"].push_back({
+            {"name", stage.name},
+            {"mean_us", mean_us(stage)},
+            {"p50_us", percentile_us(stage, 50)},
+            {"p99_us", percentile_us(stage, 99)}
+        });
+    }
+    report["decode_host_us"] = per_token_us;
+    printf("decode host budget = %.2f us/token\n", per_token_us);
+    printf("##################################\n");
+    if (!output.empty()) {
+        std::ofstream ofs(output);
+        ofs << report.dump(2) << std::endl;
+        printf("results are saved to %s\n", output.c_str());
+    }
+    unlink((dir + "/tokenizer.txt").c_str());
+    unlink((dir + "/embeddings_bf16.bin").c_str());
+    rmdir(dir.c_str());
+    return 0;
+}
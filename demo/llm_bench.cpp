@@ -0,0 +1,202 @@
+//
+//  llm_bench.cpp
+//
+//  Reproducible sweep of prompt and generation lengths, percentile latency as json.
+//
+
+#include "llm.hpp"
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+using Clock = std::chrono::steady_clock;
+
+static int64_t elapsed_us(Clock::time_point st) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - st).count();
+}
+
+static std::vector<int> parse_list(const char* str) {
+    std::vector<int> values;
+    std::istringstream stream(str);
+    for (std::string num; std::getline(stream, num, ',');) {
+        values.push_back(atoi(num.c_str()));
+    }
+    return values;
+}
+
+// nearest rank
+static double percentile(std::vector<int64_t> samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t rank = static_cast<size_t>(p / 100 * samples.size() + 0.5);
+    return static_cast<double>(samples[std::min(std::max<size_t>(rank, 1), samples.size()) - 1]);
+}
+
+static json latency_json(const std::vector<int64_t>& samples) {
+    double sum = 0;
+    for (auto us : samples) {
+        sum += us;
+    }
+    return {
+        {"p50_ms", percentile(samples, 50) / 1e3},
+        {"p90_ms", percentile(samples, 90) / 1e3},
+        {"p99_ms", percentile(samples, 99) / 1e3},
+        {"mean_ms", samples.empty() ? 0 : sum / samples.size() / 1e3},
+        {"samples", samples.size()}
+    };
+}
+
+static json load_json(const LoadStats& load) {
+    return {{"tokenizer_ms", load.tokenizer_us / 1e3}, {"embedding_ms", load.embedding_us / 1e3},
+            {"module_ms", load.module_us / 1e3}, {"ready_ms", load.ready_us / 1e3}};
+}
+
+static json memory_json(const Llm* llm) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    auto stats = llm->memory_stats();
+    json memory = {
+        // kilobytes on linux
+        {"peak_rss_mb", usage.ru_maxrss / 1024.0},
+        {"weights_mb", stats.weights / 1048576.0},
+        {"kv_allocated_mb", stats.kv_allocated / 1048576.0},
+        {"inputs_mb", stats.inputs / 1048576.0},
+        {"tokenizer_mb", stats.tokenizer / 1048576.0}
+    };
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    auto info = mallinfo2();
+    memory["heap_in_use_mb"] = info.uordblks / 1048576.0;
+    memory["heap_free_mb"] = info.fordblks / 1048576.0;
+    memory["mmap_mb"] = info.hblkhd / 1048576.0;
+#endif
+    return memory;
+}
+
+// fixed text, the prompt of every length is a prefix of its ids so runs are comparable across builds
+static std::vector<int> make_prompt(Llm* llm, int length) {
+    const std::string text =
+        "The quick brown fox jumps over the lazy dog. Large language models run a prefill pass over the prompt, "
+        "then decode one token at a time while the key value cache grows. ";
+    // the bos / prefix tokens lead the prompt once, the text repeats without them
+    auto unit = llm->encode(text, false);
+    auto ids = llm->encode("", true);
+    while (static_cast<int>(ids.size()) < length) {
+        ids.insert(ids.end(), unit.begin(), unit.end());
+    }
+    ids.resize(length);
+    return ids;
+}
+
+struct Run {
+    int64_t ttft_us = 0;
+    int64_t decode_us = 0;
+    std::vector<int64_t> itl_us;
+};
+
+// stop tokens are ignored so every run generates exactly gen_len tokens
+static Run run_once(Llm* llm, const std::vector<int>& prompt, int gen_len) {
+    Run run;
+    llm->generate_init(false);
+    auto ids = prompt;
+    auto st = Clock::now();
+    auto logits = llm->prefill(prompt);
+    int token = llm->sample(logits, ids);
+    run.ttft_us = elapsed_us(st);
+    auto decode_st = Clock::now();
+    for (int i = 1; i < gen_len; i++) {
+        auto token_st = Clock::now();
+        ids.push_back(token);
+        logits = llm->forward({token});
+        token = llm->sample(logits, ids);
+        run.itl_us.push_back(elapsed_us(token_st));
+    }
+    run.decode_us = elapsed_us(decode_st);
+    return run;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " config.json [prompt_lens = 16,64,256,1024,4096] [gen_lens = 32,128]"
+                  << " [repeat = 5] [warmup = 2] [output = llm_bench.json]" << std::endl;
+        return 0;
+    }
+    std::string model_dir = argv[1];
+    auto prompt_lens = parse_list(argc > 2 ? argv[2] : "16,64,256,1024,4096");
+    auto gen_lens = parse_list(argc > 3 ? argv[3] : "32,128");
+    int repeat = std::max(argc > 4 ? atoi(argv[4]) : 5, 1);
+    int warmup = std::max(argc > 5 ? atoi(argv[5]) : 2, 0);
+    std::string output = argc > 6 ? argv[6] : "llm_bench.json";
+    // cold load with the model files dropped from page cache, the bench model below loads warm
+    json cold;
+    {
+        std::unique_ptr<Llm> llm(Llm::createLLM(model_dir));
+        llm->set_config(R"({"load_cold": true})");
+        llm->load();
+        cold = load_json(llm->load_stats());
+    }
+    std::unique_ptr<Llm> llm(Llm::createLLM(model_dir));
+    // greedy with a fixed seed, the same tokens are decoded on every run
+    llm->set_config(R"({"temperature": 0, "seed": 0, "reuse_kv": false, "streaming_kv": false})");
+    llm->load();
+    auto& load = llm->load_stats();
+    json report = {
+        {"config", json::parse(llm->dump_config(), nullptr, false)},
+        {"repeat", repeat},
+        {"warmup", warmup},
+        {"load", {{"cold", cold}, {"warm", load_json(load)}}},
+        {"results", json::array()}
+    };
+    printf("\n#################################\n");
+    printf("prompt |  gen | ttft p50/p90/p99 (ms)   | itl p50/p90/p99 (ms)    | prefill tok/s | decode tok/s | peak rss MB\n");
+    for (auto prompt_len : prompt_lens) {
+        auto prompt = make_prompt(llm.get(), prompt_len);
+        for (auto gen_len : gen_lens) {
+            if (llm->max_context() > 0 && prompt_len + gen_len > llm->max_context()) {
+                printf("%6d | %4d | skipped, exceeds max context %d\n", prompt_len, gen_len, llm->max_context());
+                continue;
+            }
+            for (int i = 0; i < warmup; i++) {
+                run_once(llm.get(), prompt, gen_len);
+            }
+            std::vector<int64_t> ttft, itl;
+            int64_t prefill_us = 0, decode_us = 0;
+            for (int i = 0; i < repeat; i++) {
+                auto run = run_once(llm.get(), prompt, gen_len);
+                ttft.push_back(run.ttft_us);
+                itl.insert(itl.end(), run.itl_us.begin(), run.itl_us.end());
+                prefill_us += run.ttft_us;
+                decode_us += run.decode_us;
+            }
+            double prefill_speed = prompt_len * repeat / (prefill_us / 1e6);
+            double decode_speed = decode_us > 0 ? (gen_len - 1) * repeat / (decode_us / 1e6) : 0;
+            auto memory = memory_json(llm.get());
+            printf("%6d | %4d | %7.2f %7.2f %7.2f | %7.2f %7.2f %7.2f | %13.2f | %12.2f | %11.1f\n", prompt_len, gen_len,
+                   percentile(ttft, 50) / 1e3, percentile(ttft, 90) / 1e3, percentile(ttft, 99) / 1e3,
+                   percentile(itl, 50) / 1e3, percentile(itl, 90) / 1e3, percentile(itl, 99) / 1e3,
+                   prefill_speed, decode_speed, memory["peak_rss_mb"].get<double>());
+            report["results"].push_back({
+                {"prompt_len", prompt_len},
+                {"gen_len", gen_len},
+                {"ttft", latency_json(ttft)},
+                {"itl", latency_json(itl)},
+                {"prefill_tok_s", prefill_speed},
+                {"decode_tok_s", decode_speed},
+                {"memory", memory}
+            });
+        }
+    }
+    printf("##################################\n");
+    std::ofstream ofs(output);
+    if (!ofs.is_open()) {
+        printf("Failed: can't open %s\n", output.c_str());
+        return 1;
+    }
+    ofs << report.dump(2) << std::endl;
+    printf("results are saved to %s\n", output.c_str());
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ *  llm_c_demo.c
+ *
+ *  Smoke test of the C ABI: load, tokenize, stream a generation, save and restore the session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm_c.h"
+
+static int print_token(int32_t id, const char* text, size_t len, void* user_data) {
+    int* count = (int*)user_data;
+    (void)id;
+    fwrite(text, 1, len, stdout);
+    fflush(stdout);
+    (*count)++;
+    return 0;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s config.json [prompt] [session.bin]\n", argv[0]);
+        return 0;
+    }
+    const char* prompt = argc > 2 ? argv[2] : "Hello";
+    const char* session = argc > 3 ? argv[3] : "session.bin";
+    llm_handle* llm = llm_create(argv[1]);
+    if (!llm) {
+        printf("Failed: llm_create\n");
+        return 1;
+    }
+    if (llm_load(llm) != LLM_OK) {
+        printf("Failed: llm_load, %s\n", llm_last_error(llm));
+        llm_free(llm);
+        return 1;
+    }
+    int32_t ids[1024];
+    int n_ids = llm_tokenize(llm, prompt, 1, ids, 1024);
+    if (n_ids <= 0 || n_ids > 1024) {
+        printf("Failed: llm_tokenize returns %d, %s\n", n_ids, llm_last_error(llm));
+        llm_free(llm);
+        return 1;
+    }
+    printf("prompt tokens = %d\n", n_ids);
+    char text[4096];
+    int32_t out_ids[256];
+    int streamed = 0;
+    llm_result result;
+    int count = llm_generate(llm, ids, n_ids, 64, print_token, &streamed, text, sizeof(text), out_ids, 256, &result);
+    printf("\n");
+    if (count < 0) {
+        printf("Failed: llm_generate, %s\n", llm_last_error(llm));
+        llm_free(llm);
+        return 1;
+    }
+    printf("generated = %d, streamed callbacks = %d, finish_reason = %d, ttft = %.2f ms, total = %.2f ms\n",
+           count, streamed, result.finish_reason, result.ttft_us / 1e3, result.total_us / 1e3);
+    if (strlen(text) != result.text_len && result.text_len < sizeof(text)) {
+        printf("Failed: text length %zu != %zu\n", strlen(text), result.text_len);
+    }
+    if (llm_session_save(llm, session) != LLM_OK) {
+        printf("Failed: llm_session_save, %s\n", llm_last_error(llm));
+    } else if (llm_reset(llm) != LLM_OK || llm_session_load(llm, session) != LLM_OK) {
+        printf("Failed: llm_session_load, %s\n", llm_last_error(llm));
+    } else {
+        printf("session saved to and restored from %s\n", session);
+    }
+    llm_free(llm);
+    return 0;
+}
@@ -0,0 +1,515 @@
+//
+//  llm_server.cpp
+//
+//  OpenAI compatible http server, `/v1/chat/completions` and `/v1/completions`
+//  with SSE streaming, `/metrics` for latency percentiles.
+//
+
+#include "llm.hpp"
+#include "httplib.h"
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <tuple>
+#include <condition_variable>
+#include <stdlib.h>
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_s(Clock::time_point st, Clock::time_point et) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(et - st).count() / 1e6;
+}
+
+// bytes at the end of `text` that start a utf-8 sequence not complete yet
+static size_t utf8_incomplete(const std::string& text) {
+    for (size_t n = 1; n <= std::min<size_t>(text.size(), 3); n++) {
+        unsigned char c = text[text.size() - n];
+        if ((c & 0xC0) == 0x80) {
+            continue;
+        }
+        size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return len > n ? n : 0;
+    }
+    return 0;
+}
+
+// one request, produced by the worker and consumed by the http handler
+struct Job {
+    bool chat = true;
+    bool stream = false;
+    std::vector<Llm::PromptItem> messages;
+    std::string prompt;
+    json sampling;
+    GenerationControl control;
+    Clock::time_point arrive = Clock::now();
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> chunks;
+    // a token may end inside a utf-8 character, its tail waits for the next one
+    std::string pending;
+    std::string text;
+    // picked up by the worker, `error` is set when it can't be served
+    bool started = false;
+    std::string error;
+    bool done = false;
+    std::string finish_reason;
+    int prompt_tokens = 0;
+    int completion_tokens = 0;
+    void start(const std::string& reason = "") {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            started = true;
+            error = reason;
+        }
+        cv.notify_all();
+    }
+    void push(const char* str, size_t len) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.append(str, len);
+            size_t complete = pending.size() - utf8_incomplete(pending);
+            if (complete > 0) {
+                chunks.push_back(pending.substr(0, complete));
+                text += chunks.back();
+                pending.erase(0, complete);
+            }
+        }
+        cv.notify_all();
+    }
+    void finish(const std::string& reason) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!pending.empty()) {
+                chunks.push_back(pending);
+                text += pending;
+                pending.clear();
+            }
+            started = true;
+            finish_reason = reason;
+            done = true;
+        }
+        cv.notify_all();
+    }
+};
+using JobPtr = std::shared_ptr<Job>;
+
+// latency samples of the latest requests
+class Metrics {
+public:
+    void request() { std::lock_guard<std::mutex> lock(mutex_); requests_++; }
+    void reject() { std::lock_guard<std::mutex> lock(mutex_); rejected_++; }
+    void ttfb(double s) { std::lock_guard<std::mutex> lock(mutex_); add(ttfb_, s); }
+    void itl(double s) { std::lock_guard<std::mutex> lock(mutex_); add(itl_, s); tokens_++; }
+    std::string render(size_t queue_depth) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string text;
+        summary(text, "llm_ttfb_seconds", "time to first token byte", ttfb_);
+        summary(text, "llm_inter_token_seconds", "latency between streamed tokens", itl_);
+        text += "# TYPE llm_requests_total counter\nllm_requests_total " + std::to_string(requests_) + "\n";
+        text += "# TYPE llm_requests_rejected_total counter\nllm_requests_rejected_total " + std::to_string(rejected_) + "\n";
+        text += "# TYPE llm_streamed_tokens_total counter\nllm_streamed_tokens_total " + std::to_string(tokens_) + "\n";
+        text += "# TYPE llm_queue_depth gauge\nllm_queue_depth " + std::to_string(queue_depth) + "\n";
+        return text;
+    }
+private:
+    // ring of the latest samples
+    struct Samples {
+        std::vector<double> values;
+        size_t next = 0;
+    };
+    static const size_t kWindow = 4096;
+    static void add(Samples& samples, double s) {
+        if (samples.values.size() < kWindow) {
+            samples.values.push_back(s);
+        } else {
+            samples.values[samples.next++ % kWindow] = s;
+        }
+    }
+    static void summary(std::string& text, const char* name, const char* help, const Samples& ring) {
+        auto samples = ring.values;
+        text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " summary\n";
+        std::sort(samples.begin(), samples.end());
+        for (double q : {0.5, 0.9, 0.99}) {
+            double value = samples.empty() ? 0 : samples[std::min(samples.size() - 1, static_cast<size_t>(q * samples.size()))];
+            char line[128];
+            snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.6f\n", name, q, value);
+            text += line;
+        }
+        text += std::string(name) + "_count " + std::to_string(samples.size()) + "\n";
+    }
+    std::mutex mutex_;
+    Samples ttfb_, itl_;
+    int64_t requests_ = 0, rejected_ = 0, tokens_ = 0;
+};
+
+// requests share one llm, a single worker serves a bounded queue in order
+class Worker {
+public:
+    Worker(Llm* llm, size_t max_queue, Metrics* metrics) : llm_(llm), max_queue_(max_queue), metrics_(metrics) {
+        auto config = json::parse(llm_->dump_config(), nullptr, false);
+        seed_ = config.value("seed", -1);
+        defaults_ = {
+            {"temperature", config.value("temperature", 0.f)},
+            {"top_k", config.value("top_k", 40)},
+            {"top_p", config.value("top_p", 1.f)},
+            {"max_new_tokens", config.value("max_new_tokens", 512)}
+        };
+        thread_ = std::thread([this]() { run(); });
+    }
+    ~Worker() {
+        stop();
+    }
+    // cancel the running job and finish the queued ones, their handlers are waiting on them
+    void stop() {
+        std::deque<JobPtr> queue;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_) {
+                return;
+            }
+            stop_ = true;
+            queue.swap(queue_);
+            if (current_) {
+                current_->control.cancel();
+            }
+        }
+        cv_.notify_all();
+        for (auto& job : queue) {
+            job->finish("cancelled");
+        }
+        thread_.join();
+    }
+    int default_max_tokens() const { return defaults_["max_new_tokens"]; }
+    bool submit(JobPtr job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.size() >= max_queue_) {
+                return false;
+            }
+            queue_.push_back(job);
+        }
+        cv_.notify_one();
+        return true;
+    }
+    size_t depth() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+private:
+    void run() {
+        while (true) {
+            JobPtr job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+                if (stop_) {
+                    return;
+                }
+                job = queue_.front();
+                queue_.pop_front();
+                current_ = job;
+            }
+            serve(*job);
+            std::lock_guard<std::mutex> lock(mutex_);
+            current_.reset();
+        }
+    }
+    void serve(Job& job) {
+        llm_->generate_init(false);
+        auto input_ids = job.chat ? llm_->encode(llm_->apply_chat_template(job.messages)) : llm_->encode(job.prompt);
+        if (input_ids.empty()) {
+            job.start("prompt is empty");
+            job.finish("stop");
+            return;
+        }
+        job.start();
+        // sampling of this request, the rest falls back to the startup config
+        json patch = defaults_;
+        patch.merge_patch(job.sampling);
+        llm_->set_config(patch.dump());
+        // a request seed reseeds sampling for it, the startup seed is put back afterwards
+        bool seeded = job.sampling.contains("seed");
+        job.control.on_token = [&](int, std::string_view, const TokenStats& stats) {
+            if (stats.index == 0) {
+                metrics_->ttfb(elapsed_s(job.arrive, Clock::now()));
+            } else {
+                metrics_->itl(stats.latency_us / 1e6);
+            }
+        };
+        // text is streamed to the job through the output stream of generate
+        LlmStreamBuffer buffer([&job](const char* str, size_t len) { job.push(str, len); });
+        std::ostream os(&buffer);
+        auto result = llm_->generate(input_ids, job.control, &os);
+        if (seeded) {
+            llm_->set_config(json({{"seed", seed_}}).dump());
+        }
+        job.prompt_tokens = result.prompt_tokens;
+        job.completion_tokens = result.completion_tokens;
+        switch (result.finish_reason) {
+            case FinishReason::Length:
+            case FinishReason::ContextFull:
+                job.finish("length");
+                break;
+            case FinishReason::Cancelled:
+            case FinishReason::Deadline:
+                job.finish(finish_reason_name(result.finish_reason));
+                break;
+            default:
+                job.finish("stop");
+        }
+    }
+    Llm* llm_;
+    size_t max_queue_;
+    Metrics* metrics_;
+    json defaults_;
+    int seed_ = -1;
+    std::deque<JobPtr> queue_;
+    JobPtr current_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+static json chunk_json(const Job& job, const std::string& id, int64_t created, const std::string& model,
+                       const std::string& text, const json& finish_reason) {
+    json choice = {{"index", 0}, {"finish_reason", finish_reason}};
+    if (job.chat) {
+        choice["delta"] = text.empty() ? json::object() : json{{"content", text}};
+    } else {
+        choice["text"] = text;
+    }
+    return {
+        {"id", id},
+        {"object", job.chat ? "chat.completion.chunk" : "text_completion"},
+        {"created", created},
+        {"model", model},
+        {"choices", json::array({choice})}
+    };
+}
+
+static json result_json(const Job& job, const std::string& id, int64_t created, const std::string& model) {
+    json choice = {{"index", 0}, {"finish_reason", job.finish_reason}};
+    if (job.chat) {
+        choice["message"] = {{"role", "assistant"}, {"content", job.text}};
+    } else {
+        choice["text"] = job.text;
+    }
+    return {
+        {"id", id},
+        {"object", job.chat ? "chat.completion" : "text_completion"},
+        {"created", created},
+        {"model", model},
+        {"choices", json::array({choice})},
+        {"usage", {
+            {"prompt_tokens", job.prompt_tokens},
+            {"completion_tokens", job.completion_tokens},
+            {"total_tokens", job.prompt_tokens + job.completion_tokens}
+        }}
+    };
+}
+
+// model output may hold invalid utf-8, it is replaced instead of throwing
+static std::string dump(const json& value) {
+    return value.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+static void error_response(httplib::Response& res, int status, const std::string& message) {
+    res.status = status;
+    json error = {{"error", {{"message", message}, {"type", status == 503 ? "server_busy" : "invalid_request_error"}}}};
+    res.set_content(error.dump(), "application/json");
+}
+
+// json::value throws on a field of another type, fields are checked up front; empty when all are valid
+static std::string check_fields(const json& body, bool chat) {
+    using Check = bool (json::*)() const noexcept;
+    const std::vector<std::tuple<const char*, Check, const char*>> fields = {
+        {"stream", &json::is_boolean, "a boolean"},
+        {"model", &json::is_string, "a string"},
+        {"prompt", &json::is_string, "a string"},
+        {"max_tokens", &json::is_number_integer, "an integer"},
+        {"seed", &json::is_number_integer, "an integer"},
+        {"top_k", &json::is_number_integer, "an integer"},
+        {"temperature", &json::is_number, "a number"},
+        {"top_p", &json::is_number, "a number"},
+        {"timeout", &json::is_number, "a number"}
+    };
+    for (auto& field : fields) {
+        auto iter = body.find(std::get<0>(field));
+        if (iter != body.end() && !((*iter).*std::get<1>(field))()) {
+            return std::string("`") + std::get<0>(field) + "` must be " + std::get<2>(field);
+        }
+    }
+    if (body.contains("stop")) {
+        auto& stop = body["stop"];
+        bool strings = stop.is_array() && std::all_of(stop.begin(), stop.end(), [](const json& item) { return item.is_string(); });
+        if (!stop.is_string() && !strings) {
+            return "`stop` must be a string or an array of strings";
+        }
+    }
+    if (chat) {
+        if (!body.contains("messages") || !body["messages"].is_array()) {
+            return "`messages` is required";
+        }
+        for (auto& message : body["messages"]) {
+            if (!message.is_object()) {
+                return "`messages` must hold objects";
+            }
+            for (auto key : {"role", "content"}) {
+                if (message.contains(key) && !message[key].is_string()) {
+                    return std::string("`") + key + "` of a message must be a string";
+                }
+            }
+        }
+    }
+    return "";
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " config.json [host = 127.0.0.1] [port = 8080] [max_queue = 16]" << std::endl;
+        return 0;
+    }
+    std::string model_dir = argv[1];
+    std::string host = argc > 2 ? argv[2] : "127.0.0.1";
+    int port = argc > 3 ? atoi(argv[3]) : 8080;
+    size_t max_queue = argc > 4 ? atoi(argv[4]) : 16;
+    std::unique_ptr<Llm> llm(Llm::createLLM(model_dir));
+    llm->load();
+    Metrics metrics;
+    Worker worker(llm.get(), max_queue, &metrics);
+    std::atomic<int64_t> next_id {0};
+
+    auto completions = [&](bool chat) {
+        return [&, chat](const httplib::Request& req, httplib::Response& res) {
+            auto body = json::parse(req.body, nullptr, false);
+            if (body.is_discarded() || !body.is_object()) {
+                error_response(res, 400, "body is not a json object");
+                return;
+            }
+            auto invalid = check_fields(body, chat);
+            if (!invalid.empty()) {
+                error_response(res, 400, invalid);
+                return;
+            }
+            auto job = std::make_shared<Job>();
+            job->chat = chat;
+            job->stream = body.value("stream", false);
+            if (chat) {
+                for (auto& message : body["messages"]) {
+                    job->messages.emplace_back(message.value("role", "user"), message.value("content", ""));
+                }
+            } else {
+                job->prompt = body.value("prompt", "");
+            }
+            for (auto key : {"temperature", "top_k", "top_p", "seed"}) {
+                if (body.contains(key)) {
+                    job->sampling[key] = body[key];
+                }
+            }
+            job->control.max_new_tokens = body.value("max_tokens", worker.default_max_tokens());
+            if (body.contains("stop")) {
+                if (body["stop"].is_string()) {
+                    job->control.stop_strings.push_back(body["stop"]);
+                } else {
+                    for (auto& stop : body["stop"]) {
+                        job->control.stop_strings.push_back(stop);
+                    }
+                }
+            }
+            if (body.contains("timeout")) {
+                job->control.set_timeout(std::chrono::milliseconds(static_cast<int64_t>(body["timeout"].get<double>() * 1000)));
+            }
+            metrics.request();
+            if (!worker.submit(job)) {
+                metrics.reject();
+                error_response(res, 503, "request queue is full");
+                return;
+            }
+            std::string id = (chat ? "chatcmpl-" : "cmpl-") + std::to_string(next_id++);
+            int64_t created = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            std::string model = body.value("model", "llm");
+            {
+                // the status is known once the worker has tokenized the prompt
+                std::unique_lock<std::mutex> lock(job->mutex);
+                job->cv.wait(lock, [&]() { return job->started; });
+                if (!job->error.empty()) {
+                    error_response(res, 400, job->error);
+                    return;
+                }
+            }
+            if (!job->stream) {
+                std::unique_lock<std::mutex> lock(job->mutex);
+                job->cv.wait(lock, [&]() { return job->done; });
+                res.set_content(dump(result_json(*job, id, created, model)), "application/json");
+                return;
+            }
+            res.set_header("Cache-Control", "no-cache");
+            res.set_chunked_content_provider("text/event-stream", [job, id, created, model](size_t, httplib::DataSink& sink) {
+                std::deque<std::string> chunks;
+                bool done;
+                {
+                    std::unique_lock<std::mutex> lock(job->mutex);
+                    job->cv.wait(lock, [&]() { return job->done || !job->chunks.empty(); });
+                    chunks.swap(job->chunks);
+                    done = job->done;
+                }
+                for (auto& chunk : chunks) {
+                    auto event = "data: " + dump(chunk_json(*job, id, created, model, chunk, nullptr)) + "\n\n";
+                    if (!sink.write(event.data(), event.size())) {
+                        // client is gone, stop generating for it
+                        job->control.cancel();
+                        return false;
+                    }
+                }
+                if (done) {
+                    auto event = "data: " + dump(chunk_json(*job, id, created, model, "", job->finish_reason)) + "\n\n" +
+                                 "data: [DONE]\n\n";
+                    sink.write(event.data(), event.size());
+                    sink.done();
+                }
+                return true;
+            }, [job](bool success) {
+                if (!success) {
+                    job->control.cancel();
+                }
+            });
+        };
+    };
+
+    httplib::Server server;
+    // streaming responses hold a handler thread each
+    server.new_task_queue = [max_queue]() { return new httplib::ThreadPool(max_queue + 4); };
+    server.set_keep_alive_max_count(100);
+    server.set_keep_alive_timeout(30);
+    server.Post("/v1/chat/completions", completions(true));
+    server.Post("/v1/completions", completions(false));
+    server.Get("/metrics", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(metrics.render(worker.depth()), "text/plain; version=0.0.4");
+    });
+    // timing trace of the latest requests, `POST /trace?enable=0|1` toggles it
+    server.Get("/trace", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(llm->tracer().to_chrome_trace(), "application/json");
+    });
+    server.Post("/trace", [&](const httplib::Request& req, httplib::Response& res) {
+        bool enable = req.get_param_value("enable") != "0";
+        llm->tracer().enable(enable);
+        res.set_content(json({{"trace", enable}}).dump(), "application/json");
+    });
+    server.Get("/health", [](const httplib::Request&, httplib::Response& res) {
+        res.set_content("{\"status\": \"ok\"}", "application/json");
+    });
+    printf("llm server listening on http://%s:%d\n", host.c_str(), port);
+    bool listened = server.listen(host.c_str(), port);
+    // handlers still waiting on jobs must return before the server joins its threads
+    worker.stop();
+    if (!listened) {
+        printf("Failed: can't listen on %s:%d\n", host.c_str(), port);
+        return 1;
+    }
+    return 0;
+}
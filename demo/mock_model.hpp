@@ -0,0 +1,67 @@
+//
+//  mock_model.hpp
+//
+//  Files of a synthetic model for the mock backend, shared by host_bench and llm_test.
+//
+
+#ifndef MOCK_MODEL_hpp
+#define MOCK_MODEL_hpp
+
+#include <string>
+#include <set>
+#include <random>
+#include <fstream>
+#include <cstdint>
+
+#include "tokenizer.hpp"
+
+static const std::string base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string base64_encode(const std::string& str) {
+    std::string out;
+    // only the low 24 bits are pending, older bits are masked off before they overflow
+    uint32_t val = 0;
+    int bits = -6;
+    for (unsigned char c : str) {
+        val = ((val << 8) | c) & 0xFFFFFF;
+        bits += 8;
+        while (bits >= 0) {
+            out.push_back(base64_chars[(val >> bits) & 0x3F]);
+            bits -= 6;
+        }
+    }
+    if (bits > -6) {
+        out.push_back(base64_chars[((val << 8) >> (bits + 8)) & 0x3F]);
+    }
+    while (out.size() % 4) {
+        out.push_back('=');
+    }
+    return out;
+}
+
+// tiktoken vocab: 256 bytes, then deterministic lowercase words, the last id is the stop token
+static void write_tokenizer(const std::string& path, int vocab_size) {
+    std::ofstream ofs(path);
+    ofs << Tokenizer::MAGIC_NUMBER << " " << Tokenizer::TIKTOIKEN << "\n";
+    ofs << "0 1 0\n" << vocab_size - 1 << "\n";
+    ofs << vocab_size << "\n";
+    std::mt19937 rng(0);
+    std::set<std::string> words;
+    for (int i = 0; i < vocab_size; i++) {
+        std::string token;
+        if (i < 256) {
+            token = std::string(1, static_cast<char>(i));
+        } else {
+            do {
+                int len = 2 + rng() % 7;
+                token = rng() % 2 ? " " : "";
+                for (int j = 0; j < len; j++) {
+                    token.push_back('a' + rng() % 26);
+                }
+            } while (!words.insert(token).second);
+        }
+        ofs << base64_encode(token) << "\n";
+    }
+}
+
+#endif // MOCK_MODEL_hpp
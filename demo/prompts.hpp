@@ -0,0 +1,34 @@
+//
+//  prompts.hpp
+//
+//  Prompt file reader shared by cli_demo and the benches.
+//
+
+#ifndef PROMPTS_hpp
+#define PROMPTS_hpp
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+// one prompt per line, a literal "\n" is a newline
+static std::vector<std::string> read_prompts(const std::string& prompt_file) {
+    std::ifstream prompt_fs(prompt_file);
+    std::vector<std::string> prompts;
+    std::string prompt;
+    while (std::getline(prompt_fs, prompt)) {
+        // prompt start with '#' will be ignored
+        if (prompt.substr(0, 1) == "#") {
+            continue;
+        }
+        std::string::size_type pos = 0;
+        while ((pos = prompt.find("\\n", pos)) != std::string::npos) {
+            prompt.replace(pos, 2, "\n");
+            pos += 1;
+        }
+        prompts.push_back(prompt);
+    }
+    return prompts;
+}
+
+#endif // PROMPTS_hpp
@@ -0,0 +1,63 @@
+//
+//  soak_bench.cpp
+//
+//  Long running decode with streaming kv cache, report latency drift.
+//
+
+#include "llm.hpp"
+#include <chrono>
+#include <stdlib.h>
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " config.json [tokens = 100000] [window = 1000]" << std::endl;
+        return 0;
+    }
+    std::string model_dir = argv[1];
+    int total_tokens = argc > 2 ? atoi(argv[2]) : 100000;
+    int window = argc > 3 ? atoi(argv[3]) : 1000;
+    std::cout << "model path is " << model_dir << std::endl;
+    std::unique_ptr<Llm> llm(Llm::createLLM(model_dir));
+    llm->set_config(R"({"streaming_kv": true})");
+    llm->load();
+    llm->generate_init(false);
+    // prefill
+    std::vector<int> recent_ids = llm->tokenizer("Tell me a very long story.");
+    auto logits = llm->forward(recent_ids, true);
+    int token = llm->sample(logits, recent_ids);
+    // decode, stop tokens are ignored to keep generating
+    const int penalty_window = 64;
+    std::vector<double> window_ms;
+    double window_sum = 0, first_ms = 0, last_ms = 0;
+    for (int i = 1; i <= total_tokens; i++) {
+        recent_ids.push_back(token);
+        if (recent_ids.size() > penalty_window) {
+            recent_ids.erase(recent_ids.begin());
+        }
+        auto st = std::chrono::steady_clock::now();
+        logits = llm->forward({token});
+        token = llm->sample(logits, recent_ids);
+        auto et = std::chrono::steady_clock::now();
+        window_sum += std::chrono::duration_cast<std::chrono::microseconds>(et - st).count() / 1e3;
+        if (i % window == 0) {
+            double avg_ms = window_sum / window;
+            window_ms.push_back(avg_ms);
+            printf("tokens = %7d, kv len = %5d, avg latency = %.3f ms\n", i, llm->all_seq_len_, avg_ms);
+            window_sum = 0;
+        }
+    }
+    if (window_ms.empty()) {
+        return 0;
+    }
+    first_ms = window_ms.front();
+    last_ms = window_ms.back();
+    double max_ms = *std::max_element(window_ms.begin(), window_ms.end());
+    printf("\n#################################\n");
+    printf("decode tokens num = %d\n", total_tokens);
+    printf("  first window = %.3f ms/tok\n", first_ms);
+    printf("   last window = %.3f ms/tok\n", last_ms);
+    printf("    max window = %.3f ms/tok\n", max_ms);
+    printf("latency drift  = %.2f %%\n", (last_ms - first_ms) / first_ms * 100);
+    printf("##################################\n");
+    return 0;
+}
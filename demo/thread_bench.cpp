@@ -0,0 +1,49 @@
+//
+//  thread_bench.cpp
+//
+//  Prefill and decode speed of each thread count.
+//
+
+#include "llm.hpp"
+#include "prompts.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+int main(int argc, const char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " config.json prompt.txt [thread_nums = 1,2,4,8,16]" << std::endl;
+        return 0;
+    }
+    std::string model_dir = argv[1];
+    auto prompts = read_prompts(argv[2]);
+    std::vector<int> thread_nums;
+    std::istringstream thread_str(argc > 3 ? argv[3] : "1,2,4,8,16");
+    for (std::string num; std::getline(thread_str, num, ',');) {
+        thread_nums.push_back(atoi(num.c_str()));
+    }
+    std::vector<std::pair<float, float>> speeds;
+    for (auto thread_num : thread_nums) {
+        std::unique_ptr<Llm> llm(Llm::createLLM(model_dir));
+        llm->set_config("{\"thread_num\": " + std::to_string(thread_num) + "}");
+        llm->load();
+        int prompt_len = 0, decode_len = 0;
+        int64_t prefill_time = 0, decode_time = 0;
+        std::ostringstream null_os;
+        for (auto& prompt : prompts) {
+            llm->response(prompt, &null_os);
+            prompt_len += llm->prompt_len_;
+            decode_len += llm->gen_seq_len_;
+            prefill_time += llm->prefill_us_;
+            decode_time += llm->decode_us_;
+        }
+        speeds.emplace_back(prompt_len / (prefill_time / 1e6), decode_len / (decode_time / 1e6));
+    }
+    printf("\n#################################\n");
+    printf("thread_num | prefill tok/s | decode tok/s\n");
+    for (size_t i = 0; i < thread_nums.size(); i++) {
+        printf("%10d | %13.2f | %12.2f\n", thread_nums[i], speeds[i].first, speeds[i].second);
+    }
+    printf("##################################\n");
+    return 0;
+}
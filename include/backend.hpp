@@ -0,0 +1,144 @@
+//
+//  backend.hpp
+//
+//  Backend neutral tensor and module, implemented by nncase and onnxruntime.
+//
+
+#ifndef BACKEND_hpp
+#define BACKEND_hpp
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+enum class DataType {
+    Float32 = 0,
+    Int32 = 1,
+    Int64 = 2,
+    Float16 = 3,
+    BFloat16 = 4,
+    Int16 = 5,
+    Int8 = 6,
+    UInt8 = 7
+};
+
+static inline size_t data_type_size(DataType dtype) {
+    switch (dtype) {
+        case DataType::Float32:
+        case DataType::Int32:
+            return 4;
+        case DataType::Int64:
+            return 8;
+        case DataType::Float16:
+        case DataType::BFloat16:
+        case DataType::Int16:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+enum MapAccess {
+    MAP_READ = 1,
+    MAP_WRITE = 2,
+    MAP_READ_WRITE = 3
+};
+
+// host accessible tensor, map before touching the data and unmap to hand it back to the device
+class Tensor {
+public:
+    virtual ~Tensor() = default;
+    DataType dtype() const { return dtype_; }
+    const std::vector<int>& shape() const { return shape_; }
+    size_t elements() const {
+        size_t size = 1;
+        for (auto dim : shape_) {
+            size *= dim;
+        }
+        return size;
+    }
+    size_t bytes() const { return elements() * data_type_size(dtype_); }
+    virtual void* map(MapAccess access) = 0;
+    virtual void unmap() = 0;
+    template <typename T>
+    T* map(MapAccess access) { return reinterpret_cast<T*>(map(access)); }
+protected:
+    DataType dtype_ = DataType::Float32;
+    std::vector<int> shape_;
+};
+using TensorPtr = std::shared_ptr<Tensor>;
+
+// wall time of one op (or one function when the runtime can't see ops) summed over the profiled run
+struct OpProfile {
+    std::string name;
+    std::string type;
+    int64_t count = 0;
+    int64_t us = 0;
+};
+
+// a loaded model
+class Module {
+public:
+    virtual ~Module() = default;
+    // inputs: inputs_embeds, attention_mask, position_ids, past_key_values
+    // outputs: logits, presents
+    virtual std::vector<TensorPtr> forward(const std::vector<TensorPtr>& inputs) = 0;
+    // write presents into at most `buffers` preallocated kv buffers instead of new outputs every step,
+    // one per kv held between steps plus the one being written
+    virtual void bind_kv_cache(const std::vector<int>& /* shape */, int /* buffers */ = 2) {}
+    // rows [start, start + count) of presents on `axis` written by the next forward, a backend keeping
+    // the kv cache in its own buffers copies only these
+    virtual void set_kv_rows(int /* axis */, int /* start */, int /* count */) {}
+    // shape specialized entry points, eg: `prefill_256` and `decode`; empty name is the default one
+    virtual bool has_function(const std::string& name) { return name.empty(); }
+    virtual void select_function(const std::string& /* name */) {}
+    virtual size_t weight_size() const = 0;
+    // aggregated op times since load when created with `profile`, writes the trace file of the backend
+    virtual std::vector<OpProfile> profile() { return {}; }
+};
+
+struct BackendOptions {
+    // nncase: back kv cache and inputs with cached mmz buffers (host stand-in on x86_64)
+    bool mmz_alloc = false;
+    // nncase: load kmodel from a read-only mapping, populate it at load time
+    bool use_mmap = false;
+    bool mmap_prefetch = false;
+    // ort: thread pools, eg: thread_affinity = "1,2;3,4"
+    int intra_threads = 1;
+    int inter_threads = 1;
+    std::string thread_affinity;
+    bool allow_spinning = false;
+    // ort: 0: disable, 1: basic, 2: extended, 3: all
+    int optimization_level = 2;
+    bool memory_arena = false;
+    bool memory_pattern = false;
+    std::string optimized_model_path;
+    // time every op (ort) or every function invoke (nncase), traces are written as `{profile_prefix}_*.json`
+    bool profile = false;
+    std::string profile_prefix = "llm_profile";
+    // mock: vocab of the fake logits and the least time of one forward
+    int mock_vocab_size = 32000;
+    int mock_delay_us = 0;
+};
+
+class Backend {
+public:
+    virtual ~Backend() = default;
+    // type: `nncase`, `ort`, `mock` for a host only fake model, or `cpu` for the default one of this build
+    static std::shared_ptr<Backend> create(const std::string& type, const BackendOptions& options);
+    static std::string resolve(const std::string& type);
+    virtual std::string name() const = 0;
+    virtual TensorPtr create_tensor(DataType dtype, const std::vector<int>& shape) = 0;
+    virtual TensorPtr clone(const TensorPtr& tensor);
+    virtual std::shared_ptr<Module> load(const std::string& path) = 0;
+    virtual void shrink_memory() {}
+};
+
+template <typename T>
+static TensorPtr _Input(const std::vector<int>& shape, const std::shared_ptr<Backend>& backend) {
+    return backend->create_tensor(std::is_same<T, float>::value ? DataType::Float32 : DataType::Int32, shape);
+}
+
+#endif // BACKEND_hpp
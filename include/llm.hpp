@@ -8,8 +8,6 @@
 #ifndef LLM_hpp
 #define LLM_hpp
 
-#define ORT 0
-
 #include <vector>
 #include <memory>
 #include <string>
@@ -18,20 +16,25 @@
 #include <streambuf>
 #include <functional>
 #include <unordered_map>
+#include <random>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <string_view>
 
-#if ORT
-#include "ortwrapper.hpp"
-#else
-#include "nncasewrapper.hpp"
-#endif
+#include "backend.hpp"
+#include "mappedfile.hpp"
+#include "trace.hpp"
 #include "tokenizer.hpp"
 #include "json.hpp"
 
-using namespace Ort;
 using json = nlohmann::json;
 class Tokenizer;
 class Pipeline;
 class LlmConfig;
+class Conversation;
 
 // Llm start
 // llm stream buffer with callback
@@ -66,6 +69,92 @@ struct Prompt {
     std::vector<int> tokens;
 };
 
+// time to ready of each component in load, in us
+struct LoadStats {
+    int64_t tokenizer_us = 0;
+    int64_t embedding_us = 0;
+    int64_t module_us = 0;
+    int64_t ready_us = 0;
+};
+
+enum class FinishReason {
+    // not generated, eg: an empty prompt
+    None = 0,
+    // stop token of the model
+    Stop,
+    StopString,
+    // token budget
+    Length,
+    ContextFull,
+    Cancelled,
+    Deadline
+};
+const char* finish_reason_name(FinishReason reason);
+
+struct TokenStats {
+    // position of the first token of this callback in the generation
+    int index = 0;
+    // ids of this callback, more than one with `token_batch`
+    const int* ids = nullptr;
+    int count = 0;
+    // time to first token, time since start and since the previous callback, in us
+    int64_t ttft_us = 0;
+    int64_t elapsed_us = 0;
+    int64_t latency_us = 0;
+};
+// text is only valid during the call
+using TokenCallback = std::function<void(int id, std::string_view text, const TokenStats& stats)>;
+
+// checked between forwards, cancel and deadline may be set from another thread
+struct GenerationControl {
+    std::atomic<bool> cancelled {false};
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // generated tokens, <= 0 for config `max_new_tokens`
+    int max_new_tokens = -1;
+    std::vector<std::string> stop_strings;
+    // called with the new text of every `token_batch` tokens, and once for the rest
+    TokenCallback on_token;
+    int token_batch = 1;
+    void cancel() { cancelled = true; }
+    void set_timeout(std::chrono::milliseconds timeout) { deadline = std::chrono::steady_clock::now() + timeout; }
+};
+
+struct GenerationResult {
+    std::string text;
+    std::vector<int> ids;
+    FinishReason finish_reason = FinishReason::None;
+    int prompt_tokens = 0;
+    int completion_tokens = 0;
+    // time to first token, total time and the time each token is produced, in us from the start
+    int64_t ttft_us = 0;
+    int64_t total_us = 0;
+    std::vector<int64_t> token_us;
+};
+
+// speculative decoding counters of the last generation
+struct SpeculativeStats {
+    int64_t rounds = 0;
+    // draft tokens proposed and accepted by the target model
+    int64_t proposed = 0;
+    int64_t accepted = 0;
+    // tokens produced by speculative rounds, accepted plus one from the target each round
+    int64_t tokens = 0;
+    int64_t verify_us = 0;
+    int64_t us = 0;
+    float acceptance_rate() const { return proposed > 0 ? static_cast<float>(accepted) / proposed : 0.f; }
+};
+
+// memory of a llm in bytes
+struct MemoryStats {
+    size_t weights = 0;       // kmodel loaded by module
+    size_t kv_allocated = 0;  // kv cache tensor
+    size_t kv_used = 0;       // part of kv cache holding tokens
+    size_t inputs = 0;        // embedding, mask and position ids of the last forward
+    size_t tokenizer = 0;     // vocab tables
+    size_t embedding = 0;     // mapped embedding table, paged in on demand
+    size_t total() const { return weights + kv_allocated + inputs + tokenizer; }
+};
+
 class Llm {
 public:
     using PromptItem = std::pair<std::string, std::string>; // <role, content>
@@ -75,22 +164,67 @@ public:
     void reset();
     static Llm* createLLM(const std::string& config_path);
     virtual void load();
-    nncase::tensor forward(const std::vector<int>& input_ids);
-    int sample(nncase::tensor& logits, const std::vector<int>& pre_ids);
+    // load tokenizer, embedding and module in parallel, tokenizer() is usable once tokenizer is ready
+    std::future<void> load_async();
+    bool tokenizer_ready() const {
+        return tokenizer_ && (!tokenizer_ready_.valid() ||
+               tokenizer_ready_.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    }
+    const LoadStats& load_stats() const { return load_stats_; }
+    // `prefill` marks a prompt chunk, a single token is taken as a decode step otherwise
+    TensorPtr forward(const std::vector<int>& input_ids, bool prefill = false);
+    TensorPtr prefill(const std::vector<int>& input_ids);
+    // prefill one chunk from `pos` and advance it, lets a long prompt interleave with other work
+    TensorPtr prefill_step(const std::vector<int>& input_ids, int& pos);
+    int sample(TensorPtr& logits, const std::vector<int>& pre_ids);
+    int sample(float* scores, int size, const std::vector<int>& pre_ids);
+    // one decode token for every kv slot of a batch export, position < 0 marks an empty slot
+    TensorPtr forward_batch(const std::vector<int>& tokens, const std::vector<int>& positions, TensorPtr& past_key_values);
+    bool batch_enabled() const;
+    // kv cache and history of the context, restored on a model with the same kv shape
+    bool save_session(const std::string& path) const;
+    bool load_session(const std::string& path);
+    // drop the latest `tokens` entries of kv cache
+    void rollback(int tokens);
+    const SpeculativeStats& speculative_stats() const { return spec_stats_; }
+    // timing trace of the host path, enabled by config `trace` or at runtime
+    Tracer& tracer() { return tracer_; }
+    virtual std::vector<int> tokenizer(const std::string& query);
+    // raw text to ids, no prompt template
+    virtual std::vector<int> encode(const std::string& text, bool with_prefix = true);
+    // append the text of id to out
+    void decode(int id, std::string& out);
     std::string apply_prompt_template(const std::string& user_content) const;
     std::string apply_chat_template(const std::vector<PromptItem>& chat_prompts) const;
     std::string response(const std::string& user_content, std::ostream* os = &std::cout, const char* end_with = nullptr);
     std::string response(const std::vector<PromptItem>& chat_prompts, std::ostream* os = &std::cout, const char* end_with = nullptr);
     float response(const std::string& input_id_file, const std::string& target_id_file);
     void generate_init();
+    void generate_init(bool keep_context);
     std::string generate(const std::vector<int>& input_ids, std::ostream* os, const char* end_with);
+    GenerationResult generate(const std::vector<int>& input_ids, GenerationControl& control, std::ostream* os = nullptr);
     std::vector<int> generate(const std::vector<int>& input_ids, int max_new_tokens = -1);
+    // n sampled completions of one prefill, needs temperature > 0; greedy decodes one and returns n copies
+    std::vector<std::string> generate_n(const std::string& prompt, int n);
     float generate(const std::vector<int>& input_ids, const std::vector<int>& target_ids);
     void print_speed();
+    // op time table of the run with config `profile`, ends profiling on ort
+    void print_profile();
     // config function
     std::string dump_config();
+    // merge a json patch, `seed` reseeds sampling
     bool set_config(const std::string& content);
+    // context info
+    int max_context() const { return max_context_; }
+    // rows of the embedding table, token ids must be below it
+    int embedding_rows() const { return embedding_rows_; }
+    // tokens the next forward may take before the kv cache is full, INT_MAX when unbounded
+    int context_room() const;
+    MemoryStats memory_stats() const;
+    std::string turn_end() const;
     friend class Pipeline;
+    friend class Conversation;
+    friend class Scheduler;
 public:
     // forward info
     int prompt_len_ = 0;
@@ -106,16 +240,64 @@ protected:
     std::shared_ptr<LlmConfig> config_;
     std::shared_ptr<Tokenizer> tokenizer_;
     std::vector<int> key_value_shape_ = {};
-    nncase::value_t past_key_values_ {nullptr};
-    std::shared_ptr<RuntimeManager> runtime_manager_;
+    int max_context_ = 0;
+    int kv_capacity_ = 0;
+    size_t input_bytes_ = 0;
+    // tokens evicted from kv cache by streaming mode
+    int evicted_len_ = 0;
+    // shape specialized functions of the model, `prefill_{len}` and `decode`
+    std::vector<int> prefill_lens_;
+    bool decode_function_ = false;
+    std::string function_;
+    // speculative decoding, draft_ holds ids[0, draft_len_) in its kv cache
+    std::shared_ptr<Llm> draft_;
+    int draft_len_ = 0;
+    bool speculative_ = true;
+    SpeculativeStats spec_stats_;
+    // prompt lookup, n-gram hash -> index of the token after its newest occurrence
+    std::unordered_map<uint64_t, int> ngram_index_;
+    int ngram_indexed_ = 0;
+    TensorPtr past_key_values_;
+    std::shared_ptr<Backend> backend_;
     std::shared_ptr<Module> module_;
+    std::mt19937 rng_;
+    std::shared_future<void> tokenizer_ready_;
+    std::shared_ptr<MappedFile> embedding_table_;
+    int embedding_rows_ = 0;
+    LoadStats load_stats_;
+    std::mutex load_log_mutex_;
+    std::vector<std::string> load_log_;
+    Tracer tracer_;
     void init_runtime();
+    void init_status();
+    void load_tokenizer();
+    void load_embedding();
+    void load_module();
+    void load_draft();
+    // every load step without printing, see load_log
+    void load_components();
+    // load steps run on load_async workers, their messages are recorded and printed by one thread
+    void load_log(const char* format, ...);
+    void print_load_log();
     std::string decode(int id);
     bool is_stop(int token_id);
-    virtual std::vector<int> tokenizer(const std::string& query);
-    virtual nncase::value_t embedding(const std::vector<int>& input_ids);
-    virtual nncase::value_t gen_attention_mask(int seq_len);
-    virtual nncase::value_t gen_position_ids(int seq_len);
+    // tokens kept at the start of the kv cache by streaming eviction
+    int stream_sink() const;
+    void evict_kv(int seq_len);
+    TensorPtr new_kv_cache(int batch = 1);
+    void copy_kv_slot(const TensorPtr& src, const TensorPtr& dst, int slot);
+    bool context_full() const;
+    bool fit_context(std::vector<int>& input_ids);
+    // feed token and return the next tokens, more than one when draft tokens are accepted
+    std::vector<int> decode_step(int token, std::vector<int>& ids, int max_tokens);
+    std::vector<int> propose(const std::vector<int>& ids, int k);
+    std::vector<int> lookup(const std::vector<int>& ids, int k);
+    std::vector<int> verify(int token, const std::vector<int>& draft, std::vector<int>& ids, int max_tokens);
+    virtual TensorPtr embedding(const std::vector<int>& input_ids);
+    // tokens from pos which embedding() takes without waiting, prefill is cut there
+    virtual int ready_len(const std::vector<int>& input_ids, int pos) const { return static_cast<int>(input_ids.size()) - pos; }
+    virtual TensorPtr gen_attention_mask(int seq_len, bool decode);
+    virtual TensorPtr gen_position_ids(int seq_len, bool decode);
     template <typename T>
     void read_binary_file(const std::string &file_name, std::vector<T> &v);
     template <typename T>
@@ -124,4 +306,63 @@ protected:
 };
 // Llm end
 
+// Lvlm start
+// vision language model: `<img>path or url</img>` in a prompt becomes vision_start, image_tokens x image_pad
+// and vision_end, embedding() replaces the pad rows with the visual encoder output of the image
+class Lvlm : public Llm {
+public:
+    Lvlm(std::shared_ptr<LlmConfig> config);
+    virtual ~Lvlm();
+    virtual void load() override;
+    virtual std::vector<int> encode(const std::string& text, bool with_prefix = true) override;
+protected:
+    virtual TensorPtr embedding(const std::vector<int>& input_ids) override;
+    virtual int ready_len(const std::vector<int>& input_ids, int pos) const override;
+private:
+    struct Image {
+        uint64_t hash = 0;
+        // normalized [3, image_size, image_size], empty when the features are cached or decode failed
+        std::vector<float> pixels;
+    };
+    // read, hash, decode and resize, runs on a worker; decoding is skipped when the features are cached
+    Image load_image(const std::string& source, bool force_decode = false);
+    // cached or encoded by the visual module, nullptr on failure
+    TensorPtr image_features(const std::string& source, const Image& image);
+    int image_size_, image_tokens_;
+    int vision_start_, vision_end_, image_pad_;
+    // row read from the embedding table for image_pad_, 0 when the pad id is past the table
+    int pad_row_ = 0;
+    std::vector<float> image_mean_, image_norm_;
+    std::shared_ptr<Module> visual_module_;
+    // images of the latest encode in prompt order, decoded on worker threads;
+    // embedding() walks them with a cursor that survives prefill chunks
+    std::vector<std::pair<std::string, std::shared_future<Image>>> images_;
+    size_t image_index_ = 0;
+    int image_row_ = 0;
+    TensorPtr current_features_;
+    // visual encoder outputs keyed by fnv-1a of the image bytes, the oldest is dropped beyond `image_cache_size`
+    std::mutex cache_mutex_;
+    std::unordered_map<uint64_t, TensorPtr> feature_cache_;
+    std::deque<uint64_t> cache_order_;
+};
+// Lvlm end
+
+// Conversation start
+// multi-turn chat session, keep kv cache between turns and only prefill the new turn
+class Conversation {
+public:
+    using PromptItem = Llm::PromptItem;
+    Conversation(Llm* llm, const std::string& system_prompt = "You are a helpful assistant.")
+        : llm_(llm), system_prompt_(system_prompt) {}
+    std::string response(const std::string& user_content, std::ostream* os = &std::cout, const char* end_with = nullptr);
+    void reset();
+    const std::vector<PromptItem>& history() const { return history_; }
+private:
+    std::vector<int> rebuild(const std::string& user_content);
+    Llm* llm_;
+    std::string system_prompt_;
+    std::vector<PromptItem> history_;
+};
+// Conversation end
+
 #endif // LLM_hpp
@@ -0,0 +1,93 @@
+/*
+ *  llm_c.h
+ *
+ *  Stable C ABI of llm, for embedding from Go, Python and other runtimes.
+ *  Handles are opaque, outputs go to caller provided buffers.
+ */
+
+#ifndef LLM_C_h
+#define LLM_C_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define LLM_C_API __declspec(dllexport)
+#else
+#define LLM_C_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct llm_handle llm_handle;
+
+/* return codes, functions returning a size return it on success */
+#define LLM_OK 0
+#define LLM_ERROR_ARGUMENT -1
+#define LLM_ERROR_STATE -2
+#define LLM_ERROR_RUNTIME -3
+
+/* same order as FinishReason */
+typedef enum {
+    LLM_FINISH_NONE = 0,
+    LLM_FINISH_STOP = 1,
+    LLM_FINISH_STOP_STRING = 2,
+    LLM_FINISH_LENGTH = 3,
+    LLM_FINISH_CONTEXT_FULL = 4,
+    LLM_FINISH_CANCELLED = 5,
+    LLM_FINISH_DEADLINE = 6
+} llm_finish_reason;
+
+typedef struct {
+    int32_t finish_reason;
+    int32_t prompt_tokens;
+    int32_t completion_tokens;
+    int64_t ttft_us;
+    int64_t total_us;
+    /* bytes of the whole text, may exceed the text buffer */
+    size_t text_len;
+} llm_result;
+
+/* text is not NUL terminated and only valid during the call, return non zero to stop */
+typedef int (*llm_token_callback)(int32_t id, const char* text, size_t len, void* user_data);
+
+LLM_C_API llm_handle* llm_create(const char* config_path);
+LLM_C_API void llm_free(llm_handle* llm);
+LLM_C_API int llm_load(llm_handle* llm);
+/* merge a json patch into the config, eg: {"temperature": 0.7} */
+LLM_C_API int llm_set_config(llm_handle* llm, const char* json_patch);
+/* message of the last failed call on this handle */
+LLM_C_API const char* llm_last_error(llm_handle* llm);
+
+/* returns the number of ids, writes at most capacity of them; apply_template wraps text in the prompt template */
+LLM_C_API int llm_tokenize(llm_handle* llm, const char* text, int apply_template, int32_t* ids, int capacity);
+/* text of one id from the start of text, not NUL terminated; returns its length, writes at most capacity bytes */
+LLM_C_API int llm_detokenize(llm_handle* llm, int32_t id, char* text, int capacity);
+
+/* feed ids and copy the logits of the last position to logits, returns the vocab size;
+   LLM_ERROR_ARGUMENT for an id outside the vocab, LLM_ERROR_STATE when the ids don't fit in the kv cache left */
+LLM_C_API int llm_forward(llm_handle* llm, const int32_t* ids, int n_ids, float* logits, int capacity);
+
+/*
+ * generate from prompt ids, continues the context when the `reuse_kv` config is set.
+ * callback, text, out_ids and result are optional; text is NUL terminated when text_capacity > 0.
+ * returns the number of generated ids, writes at most out_ids_capacity of them; LLM_ERROR_ARGUMENT for an id outside the vocab.
+ */
+LLM_C_API int llm_generate(llm_handle* llm, const int32_t* ids, int n_ids, int max_new_tokens,
+                           llm_token_callback callback, void* user_data,
+                           char* text, size_t text_capacity,
+                           int32_t* out_ids, int out_ids_capacity, llm_result* result);
+
+/* drop the context */
+LLM_C_API int llm_reset(llm_handle* llm);
+/* kv cache and history of the context */
+LLM_C_API int llm_session_save(llm_handle* llm, const char* path);
+LLM_C_API int llm_session_load(llm_handle* llm, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LLM_C_h */
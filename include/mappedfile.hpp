@@ -0,0 +1,91 @@
+//
+//  mappedfile.hpp
+//
+//  Read-only file mapping shared by model and embedding loading.
+//
+
+#ifndef MAPPEDFILE_hpp
+#define MAPPEDFILE_hpp
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// read-only file mapping, pages are shared through the page cache
+class MappedFile {
+public:
+    MappedFile(const std::string& path, bool prefetch = false) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("can't open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st)) {
+            ::close(fd);
+            throw std::runtime_error("can't stat " + path);
+        }
+        size_ = st.st_size;
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (prefetch) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        data_ = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+        ::close(fd);
+        if (data_ == MAP_FAILED) {
+            data_ = nullptr;
+            throw std::runtime_error("can't mmap " + path);
+        }
+        if (prefetch) {
+            ::madvise(data_, size_, MADV_WILLNEED);
+        }
+    }
+    ~MappedFile() {
+        if (data_) {
+            ::munmap(data_, size_);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const void* data() const { return data_; }
+    size_t size() const { return size_; }
+    // ratio of pages already in page cache, 0 for a cold load
+    static float resident(const std::string& path) {
+        try {
+            MappedFile file(path);
+            size_t page = ::sysconf(_SC_PAGESIZE);
+            std::vector<unsigned char> pages((file.size_ + page - 1) / page);
+            if (pages.empty() || ::mincore(file.data_, file.size_, pages.data())) {
+                return 0.f;
+            }
+            size_t count = 0;
+            for (auto p : pages) {
+                count += p & 1;
+            }
+            return static_cast<float>(count) / pages.size();
+        } catch (const std::exception&) {
+            return 0.f;
+        }
+    }
+    // drop the clean page cache of a file so the next load reads from storage, pages mapped
+    // by another process stay; false when the hint isn't taken
+    static bool evict(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool done = ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+        ::close(fd);
+        return done;
+    }
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+#endif // MAPPEDFILE_hpp
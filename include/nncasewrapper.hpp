@@ -1,12 +1,12 @@
 //
-//  ortwrapper.hpp
+//  nncasewrapper.hpp
 //
 //  Created by zhaode on 2024/10/09.
 //  ZhaodeWang
 //
 
-#ifndef ORTWRAPPER_hpp
-#define ORTWRAPPER_hpp
+#ifndef NNCASEWRAPPER_hpp
+#define NNCASEWRAPPER_hpp
 
 #include <memory>
 #include <nncase/runtime/interpreter.h>
@@ -17,25 +17,243 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <mutex>
+#include <unordered_map>
+#include <cstdlib>
+#include <cstring>
+#include "mappedfile.hpp"
+#ifdef LLM_USE_MMZ
+#include "mmz/mmz.h"
+#endif
 
 namespace fs = std::filesystem;
 
-namespace Ort {
+namespace Nncase {
+
+// physically contiguous host memory shared with the device
+struct Block {
+  void *data = nullptr;
+  uintptr_t physical_address = 0;
+  size_t size = 0;
+};
+
+class Allocator {
+public:
+  virtual ~Allocator() = default;
+  Block alloc(size_t size) {
+    auto block = alloc_core(size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_[block.physical_address] = block;
+    return block;
+  }
+  void free(void *data) {
+    Block block;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto iter = blocks_.begin(); iter != blocks_.end(); ++iter) {
+        if (iter->second.data == data) {
+          block = iter->second;
+          blocks_.erase(iter);
+          break;
+        }
+      }
+    }
+    if (block.data) {
+      free_core(block);
+    }
+  }
+  // find the block of a tensor created by this allocator
+  bool find(const nncase::value_t &value, Block &block) {
+    auto tensor = value.as<nncase::tensor>();
+    if (!tensor.is_ok()) {
+      return false;
+    }
+    auto host = tensor.unwrap()->buffer().as_host();
+    if (!host.is_ok() || !host.unwrap().has_physical_address()) {
+      return false;
+    }
+    auto physical_address = host.unwrap().physical_address().unwrap();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = blocks_.find(physical_address);
+    if (iter == blocks_.end()) {
+      return false;
+    }
+    block = iter->second;
+    return true;
+  }
+  // write back cpu cache before the device reads the block
+  virtual void flush(const Block &block) = 0;
+  // drop stale cpu cache before the host reads what the device wrote
+  virtual void invalidate(const Block &block) = 0;
+
+protected:
+  virtual Block alloc_core(size_t size) = 0;
+  virtual void free_core(const Block &block) = 0;
+
+private:
+  std::mutex mutex_;
+  std::unordered_map<uintptr_t, Block> blocks_;
+};
+
+#ifdef LLM_USE_MMZ
+// cached mmz buffers on k230, coherency is kept by explicit flush
+class MmzAllocator : public Allocator {
+public:
+  MmzAllocator() { kd_mpi_mmz_init(); }
+  virtual void flush(const Block &block) override {
+    kd_mpi_sys_mmz_flush_cache(block.physical_address, block.data, block.size);
+  }
+  virtual void invalidate(const Block &block) override {
+    // flush_cache cleans and invalidates the range
+    kd_mpi_sys_mmz_flush_cache(block.physical_address, block.data, block.size);
+  }
+
+protected:
+  virtual Block alloc_core(size_t size) override {
+    Block block;
+    unsigned long physical_address = 0;
+    if (kd_mpi_sys_mmz_alloc_cached(&physical_address, &block.data, "llm", "anonymous", size)) {
+      throw std::bad_alloc();
+    }
+    block.physical_address = physical_address;
+    block.size = size;
+    return block;
+  }
+  virtual void free_core(const Block &block) override {
+    kd_mpi_sys_mmz_free(block.physical_address, block.data);
+  }
+};
+#endif
+
+// host stand-in of mmz, the virtual address is used as physical address
+class HostAllocator : public Allocator {
+public:
+  size_t flush_count = 0;
+  size_t invalidate_count = 0;
+  virtual void flush(const Block &block) override { flush_count++; }
+  virtual void invalidate(const Block &block) override { invalidate_count++; }
+
+protected:
+  virtual Block alloc_core(size_t size) override {
+    constexpr size_t alignment = 4096;
+    Block block;
+    block.size = size;
+    block.data = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (!block.data) {
+      throw std::bad_alloc();
+    }
+    block.physical_address = reinterpret_cast<uintptr_t>(block.data);
+    return block;
+  }
+  virtual void free_core(const Block &block) override { std::free(block.data); }
+};
+
+struct RuntimeOptions {
+  // back kv cache and inputs with cached mmz buffers (host stand-in on x86_64)
+  bool mmz_alloc = false;
+  // load kmodel from a read-only mapping instead of a heap copy
+  bool use_mmap = false;
+  // populate the mapping at load time
+  bool mmap_prefetch = false;
+};
 
 class RuntimeManager {
 public:
-  RuntimeManager() {}
+  RuntimeManager(const RuntimeOptions &options = {}) : options_(options) {
+    if (options_.mmz_alloc) {
+#ifdef LLM_USE_MMZ
+      allocator_.reset(new MmzAllocator());
+#else
+      allocator_.reset(new HostAllocator());
+#endif
+    }
+  }
+  const RuntimeOptions &options() const { return options_; }
+  std::shared_ptr<Allocator> allocator() const { return allocator_; }
+  void flush(const nncase::value_t &value) {
+    Block block;
+    if (allocator_ && allocator_->find(value, block)) {
+      allocator_->flush(block);
+    }
+  }
+  void invalidate(const nncase::value_t &value) {
+    Block block;
+    if (allocator_ && allocator_->find(value, block)) {
+      allocator_->invalidate(block);
+    }
+  }
+  // keep `past` in its allocator block: copy the rows [start, start + count) of `axis` the device
+  // wrote into `present` (a pool tensor) back to `past`, cache maintenance covers only those rows
+  bool copy_rows(const nncase::value_t &present, const nncase::value_t &past, int axis, int start, int count) {
+    Block block, present_block;
+    if (!allocator_ || count <= 0 || allocator_->find(present, present_block) || !allocator_->find(past, block)) {
+      return false;
+    }
+    auto src = present.as<nncase::tensor>().unwrap();
+    auto dst = past.as<nncase::tensor>().unwrap();
+    auto shape = src->shape();
+    if (shape != dst->shape() || axis >= (int)shape.size() || start + count > (int)shape[axis]) {
+      return false;
+    }
+    size_t outer = 1, inner = nncase::typecode_bytes(src->dtype()->typecode());
+    for (int i = 0; i < axis; i++) {
+      outer *= shape[i];
+    }
+    for (size_t i = axis + 1; i < shape.size(); i++) {
+      inner *= shape[i];
+    }
+    auto host = src->buffer().as_host().unwrap_or_throw();
+    bool physical = host.has_physical_address();
+    uintptr_t physical_address = physical ? host.physical_address().unwrap() : 0;
+    auto mapped = host.map(nncase::runtime::map_read).unwrap_or_throw();
+    auto data = reinterpret_cast<uint8_t *>(mapped.buffer().data());
+    auto block_data = reinterpret_cast<uint8_t *>(block.data);
+    size_t capacity = shape[axis], size = count * inner;
+    for (size_t i = 0; i < outer; i++) {
+      size_t offset = (i * capacity + start) * inner;
+      if (physical) {
+        allocator_->invalidate({data + offset, physical_address + offset, size});
+      }
+      memcpy(block_data + offset, data + offset, size);
+      allocator_->flush({block_data + offset, block.physical_address + offset, size});
+    }
+    mapped.unmap().unwrap_or_throw();
+    return true;
+  }
 
 private:
+  RuntimeOptions options_;
+  std::shared_ptr<Allocator> allocator_;
 };
 
 class Module {
 public:
   size_t count = 0;
-  Module(std::shared_ptr<RuntimeManager> runtime, const std::string &path) {
-    std::ifstream ifs(path, std::ios::binary);
-    interpreter_.load_model(ifs).unwrap_or_throw();
+  Module(std::shared_ptr<RuntimeManager> runtime, const std::string &path) : runtime_(runtime) {
+    weight_size_ = fs::file_size(path);
+    if (runtime->options().use_mmap) {
+      // interpreter runs on the mapping in place, no heap copy of the model
+      mapped_model_.reset(new MappedFile(path, runtime->options().mmap_prefetch));
+      interpreter_.load_model({reinterpret_cast<const gsl::byte*>(mapped_model_->data()), mapped_model_->size()}, false).unwrap_or_throw();
+    } else {
+      std::ifstream ifs(path, std::ios::binary);
+      interpreter_.load_model(ifs).unwrap_or_throw();
+    }
     entry_function_ = interpreter_.entry_function().unwrap_or_throw();
+    function_ = entry_function_;
+  }
+  size_t weight_size() const { return weight_size_; }
+  // shape specialized functions exported next to the entry, eg: `prefill_256`, `decode`
+  bool has_function(const std::string &name) {
+    return name.empty() || find_function(name) != nullptr;
+  }
+  // function invoked by following onForward, empty name for the entry function
+  void select_function(const std::string &name) {
+    auto function = name.empty() ? entry_function_ : find_function(name);
+    if (!function) {
+      throw std::runtime_error("kmodel has no function: " + name);
+    }
+    function_ = function;
   }
   void dump_input(std::ofstream &desc_file, nncase::value_t &input_data, std::string input_name, std::string dtype, size_t count)
   {
@@ -76,28 +294,79 @@ public:
       count+=1;
     }
   
-    return entry_function_->invoke(inputs)
+    // inputs are flushed when the host writes them, see `flush`
+    auto outputs = function_->invoke(inputs)
         .unwrap_or_throw()
         .as<nncase::tuple>()
         .unwrap_or_throw();
+    // hand the allocator backed past_key_values back as presents instead of the pool output
+    auto fields = outputs->fields();
+    if (inputs.size() > 3 && fields.size() > 1 &&
+        runtime_->copy_rows(fields[1], inputs[3], kv_axis_, kv_start_, kv_count_)) {
+      fields[1] = inputs[3];
+    }
+    kv_count_ = 0;
+    return outputs;
+  }
+  // rows [start, start + count) of `axis` in presents written by the next onForward
+  void set_kv_rows(int axis, int start, int count) {
+    kv_axis_ = axis;
+    kv_start_ = start;
+    kv_count_ = count;
   }
 
 private:
+  nncase::runtime::runtime_function *find_function(const std::string &name) {
+    auto iter = functions_.find(name);
+    if (iter == functions_.end()) {
+      auto function = interpreter_.find_function_by_name(name);
+      iter = functions_.emplace(name, function.is_ok() ? function.unwrap() : nullptr).first;
+    }
+    return iter->second;
+  }
+  std::shared_ptr<RuntimeManager> runtime_;
+  size_t weight_size_ = 0;
+  // must outlive interpreter
+  std::unique_ptr<MappedFile> mapped_model_;
   nncase::runtime::interpreter interpreter_;
   nncase::runtime::runtime_function *entry_function_;
+  nncase::runtime::runtime_function *function_;
+  std::unordered_map<std::string, nncase::runtime::runtime_function *> functions_;
+  int kv_axis_ = 0;
+  int kv_start_ = 0;
+  int kv_count_ = 0;
 };
 
-template <typename T>
-static nncase::tensor _Input(const std::vector<int> &shape,
-                             std::shared_ptr<RuntimeManager> rtmgr) {
+static nncase::tensor _Create(nncase::typecode_t datatype, const std::vector<int> &shape,
+                              std::shared_ptr<RuntimeManager> rtmgr) {
   nncase::dims_t shape_int64(shape.begin(), shape.end());
+  auto allocator = rtmgr->allocator();
+  if (!allocator) {
+    return nncase::runtime::hrt::create(
+               datatype, shape_int64, nncase::runtime::host_runtime_tensor::pool_shared)
+        .unwrap_or_throw()
+        .impl();
+  }
+  size_t size = nncase::typecode_bytes(datatype);
+  for (auto dim : shape) {
+    size *= dim;
+  }
+  auto block = allocator->alloc(size);
   return nncase::runtime::hrt::create(
-             std::is_same_v<T, float> ? nncase::dt_float32 : nncase::dt_int32,
-             shape_int64, nncase::runtime::host_runtime_tensor::pool_shared)
+             datatype, shape_int64,
+             {reinterpret_cast<gsl::byte *>(block.data), size},
+             [allocator](gsl::byte *data) { allocator->free(data); },
+             nncase::runtime::host_runtime_tensor::pool_shared, block.physical_address)
       .unwrap_or_throw()
       .impl();
 }
 
-} // namespace Ort
+template <typename T>
+static nncase::tensor _Input(const std::vector<int> &shape,
+                             std::shared_ptr<RuntimeManager> rtmgr) {
+  return _Create(std::is_same_v<T, float> ? nncase::dt_float32 : nncase::dt_int32, shape, rtmgr);
+}
+
+} // namespace Nncase
 
-#endif /* ORTWRAPPER_hpp */
\ No newline at end of file
+#endif /* NNCASEWRAPPER_hpp */
\ No newline at end of file
@@ -10,16 +10,60 @@
 
 #include <onnxruntime_cxx_api.h>
 #include <memory>
+#include <string>
 
 namespace Ort {
 
+struct RuntimeOptions {
+    // intra op threads, from `thread_num`
+    int intra_threads = 1;
+    // inter op threads, > 1 runs independent nodes in parallel
+    int inter_threads = 1;
+    // eg: "1,2;3,4" one group per intra op thread except the caller, empty for os scheduling
+    std::string thread_affinity;
+    // spin waiting threads, from `power` = high
+    bool allow_spinning = false;
+    GraphOptimizationLevel optimization_level = GraphOptimizationLevel::ORT_ENABLE_EXTENDED;
+    // cpu memory arena and memory pattern, from `memory` != low
+    bool memory_arena = false;
+    bool memory_pattern = false;
+    // save the optimized graph to load faster next time
+    std::string optimized_model_path;
+    // per node profiling, session writes `{profile_prefix}_{date}.json`
+    bool profile = false;
+    std::string profile_prefix;
+};
+
 class RuntimeManager {
 public:
-    RuntimeManager() {
+    RuntimeManager(const RuntimeOptions& options = {}) {
         env_.reset(new Ort::Env(ORT_LOGGING_LEVEL_WARNING, "onnx-llm"));
         options_.reset(new Ort::SessionOptions());
-        options_->SetIntraOpNumThreads(1);
-        options_->SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_EXTENDED);
+        options_->SetIntraOpNumThreads(options.intra_threads);
+        options_->SetInterOpNumThreads(options.inter_threads);
+        options_->SetExecutionMode(options.inter_threads > 1 ? ExecutionMode::ORT_PARALLEL : ExecutionMode::ORT_SEQUENTIAL);
+        options_->AddConfigEntry("session.intra_op.allow_spinning", options.allow_spinning ? "1" : "0");
+        options_->AddConfigEntry("session.inter_op.allow_spinning", options.allow_spinning ? "1" : "0");
+        if (!options.thread_affinity.empty()) {
+            options_->AddConfigEntry("session.intra_op_thread_affinities", options.thread_affinity.c_str());
+        }
+        options_->SetGraphOptimizationLevel(options.optimization_level);
+        if (options.memory_arena) {
+            options_->EnableCpuMemArena();
+        } else {
+            options_->DisableCpuMemArena();
+        }
+        if (options.memory_pattern) {
+            options_->EnableMemPattern();
+        } else {
+            options_->DisableMemPattern();
+        }
+        if (!options.optimized_model_path.empty()) {
+            options_->SetOptimizedModelFilePath(options.optimized_model_path.c_str());
+        }
+        if (options.profile) {
+            options_->EnableProfiling(options.profile_prefix.c_str());
+        }
         allocator_.reset(new Ort::AllocatorWithDefaultOptions());
     }
     ~RuntimeManager() {}
@@ -40,7 +84,7 @@ private:
 
 class Module {
 public:
-    Module(std::shared_ptr<RuntimeManager> runtime, const std::string& path) {
+    Module(std::shared_ptr<RuntimeManager> runtime, const std::string& path) : runtime_(runtime) {
         session_.reset(new Ort::Session(runtime->env(), path.c_str(), runtime->options()));
         input_count_ = session_->GetInputCount();
         output_count_ = session_->GetOutputCount();
@@ -59,8 +103,36 @@ public:
             output_names_.data(), output_names_.size());
         return outputs;
     }
+    // io binding forward, inputs are bound in place without copy; when `present` is given the
+    // last output (present kv) is written into it, other outputs come from the session allocator
+    std::vector<Value> onForward(const std::vector<const Value*>& inputs, const Value* present = nullptr) {
+        if (!binding_) {
+            binding_.reset(new Ort::IoBinding(*session_));
+        }
+        binding_->ClearBoundInputs();
+        binding_->ClearBoundOutputs();
+        for (size_t i = 0; i < inputs.size(); i++) {
+            binding_->BindInput(input_names_[i], *inputs[i]);
+        }
+        for (size_t i = 0; i < output_count_; i++) {
+            if (present && i + 1 == output_count_) {
+                binding_->BindOutput(output_names_[i], *present);
+            } else {
+                binding_->BindOutput(output_names_[i], memory_info_);
+            }
+        }
+        session_->Run(Ort::RunOptions{nullptr}, *binding_);
+        return binding_->GetOutputValues();
+    }
+    // stop profiling of this session and return the path of its trace
+    std::string end_profile() {
+        return session_->EndProfilingAllocated(runtime_->allocator()).get();
+    }
 private:
+    std::shared_ptr<RuntimeManager> runtime_;
     std::unique_ptr<Ort::Session> session_;
+    std::unique_ptr<Ort::IoBinding> binding_;
+    Ort::MemoryInfo memory_info_ = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
     size_t input_count_, output_count_;
     std::vector<AllocatedStringPtr> input_strs_, output_strs_;
     std::vector<const char*> input_names_, output_names_;
@@ -0,0 +1,100 @@
+//
+//  scheduler.hpp
+//
+//  Iteration level scheduling of concurrent requests on one Llm.
+//
+
+#ifndef SCHEDULER_hpp
+#define SCHEDULER_hpp
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include "llm.hpp"
+
+// Orca/vLLM style continuous batching: every step prefills one chunk of a new request and runs one
+// decode token of every running request, requests join and leave between steps.
+// With a batch export (`max_batch` > 1 and `kv_batch_axis`) decode tokens are merged into one forward
+// on per-sequence kv slots, otherwise running sequences take turns on the batch 1 module.
+class Scheduler {
+public:
+    // return false to stop the sequence
+    using TokenCallback = std::function<bool(int id, const std::string& word)>;
+    using FinishCallback = std::function<void(const std::string& text)>;
+    struct Stats {
+        int64_t steps = 0;
+        int64_t prefill_tokens = 0;
+        int64_t decode_tokens = 0;
+        int64_t prefill_us = 0;
+        int64_t decode_us = 0;
+    };
+    // max_running: sequences holding a kv cache at once, bounded by `max_batch` slots when batched
+    Scheduler(Llm* llm, int max_running = 8);
+    ~Scheduler();
+    // thread safe, returns the sequence id
+    int submit(const std::vector<int>& input_ids, int max_new_tokens = -1,
+               TokenCallback on_token = nullptr, FinishCallback on_finish = nullptr);
+    int submit(const std::string& prompt, int max_new_tokens = -1,
+               TokenCallback on_token = nullptr, FinishCallback on_finish = nullptr);
+    // run one iteration, false when there is nothing to do
+    bool step();
+    void run_until_idle();
+    // serve submitted requests on a background thread
+    void start();
+    void stop();
+    size_t pending() const;
+    bool batched() const { return batched_; }
+    const Stats& stats() const { return stats_; }
+private:
+    struct Sequence {
+        int id = 0;
+        std::vector<int> input_ids;
+        // prompt and generated ids, used by repetition penalty
+        std::vector<int> ids;
+        int max_new_tokens = 0;
+        TokenCallback on_token;
+        FinishCallback on_finish;
+        TensorPtr past_key_values;
+        int all_seq_len = 0;
+        int evicted_len = 0;
+        int gen_seq_len = 0;
+        int prefill_pos = 0;
+        int slot = -1;
+        int token = -1;
+        int generated = 0;
+        std::string text;
+        bool done = false;
+    };
+    using SequencePtr = std::shared_ptr<Sequence>;
+    void swap_in(Sequence& seq);
+    void swap_out(Sequence& seq);
+    void admit();
+    void prefill(Sequence& seq);
+    void decode_round_robin();
+    void decode_batch();
+    // report the sampled next token, false once the sequence ends
+    bool accept(Sequence& seq, int token);
+    void finish(Sequence& seq);
+    Llm* llm_;
+    int max_running_;
+    bool batched_ = false;
+    int next_id_ = 0;
+    TensorPtr batch_kv_;
+    std::vector<SequencePtr> slots_;
+    std::vector<SequencePtr> running_;
+    std::deque<SequencePtr> waiting_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread worker_;
+    std::atomic<bool> stop_ {false};
+    Stats stats_;
+};
+
+#endif // SCHEDULER_hpp
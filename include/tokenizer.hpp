@@ -76,8 +76,12 @@ public:
     static Tokenizer* createTokenizer(const std::string& filename);
     bool is_stop(int token);
     bool is_special(int token);
-    std::vector<int> encode(const std::string& str);
+    std::vector<int> encode(const std::string& str, bool with_prefix = true);
     virtual std::string decode(int id) = 0;
+    // append the text of id to out, lets a caller reuse one buffer
+    virtual void decode_append(int id, std::string& out) { out += decode(id); }
+    // approximate heap bytes of vocab tables
+    virtual size_t memory_usage() const;
 protected:
     virtual void load_special(std::ifstream& file);
     virtual bool load_vocab(std::ifstream& file) = 0;
@@ -91,6 +95,8 @@ class Sentencepiece : public Tokenizer {
 public:
     Sentencepiece() = default;
     virtual std::string decode(int id) override;
+    virtual void decode_append(int id, std::string& out) override;
+    virtual size_t memory_usage() const override;
 protected:
     virtual bool load_vocab(std::ifstream& file) override;
     virtual void encode(const std::string& str, std::vector<int>& ids) override;
@@ -143,6 +149,8 @@ class Tiktoken : public Tokenizer {
 public:
     Tiktoken() = default;
     virtual std::string decode(int id) override;
+    virtual void decode_append(int id, std::string& out) override;
+    virtual size_t memory_usage() const override;
 protected:
     virtual bool load_vocab(std::ifstream& file) override;
     virtual void encode(const std::string& str, std::vector<int>& ids) override;
@@ -172,6 +180,8 @@ using BPERanks = std::unordered_map<std::pair<std::wstring, std::wstring>, int,
 public:
     HuggingfaceTokenizer() = default;
     virtual std::string decode(int id) override;
+    virtual void decode_append(int id, std::string& out) override;
+    virtual size_t memory_usage() const override;
 protected:
     virtual bool load_vocab(std::ifstream& file) override;
     virtual void encode(const std::string& str, std::vector<int>& ids) override;
@@ -0,0 +1,99 @@
+//
+//  trace.hpp
+//
+//  Per-request, per-token timing trace of the host path.
+//
+
+#ifndef TRACE_hpp
+#define TRACE_hpp
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+enum class TraceStage {
+    Tokenize = 0,
+    Prefill,
+    Decode,
+    Embedding,
+    Mask,
+    Position,
+    Invoke,
+    Sample,
+    Detokenize,
+    Count
+};
+const char* trace_stage_name(TraceStage stage);
+
+struct TraceEvent {
+    int64_t request = 0;
+    // generation step of the request, 0 is the prompt
+    int token = 0;
+    TraceStage stage = TraceStage::Tokenize;
+    // steady clock, in us since the tracer is created
+    int64_t start_us = 0;
+    int64_t dur_us = 0;
+};
+
+// Fixed size ring of the latest events, the oldest are overwritten.
+// Disabled by default, a disabled tracer costs one relaxed load per scope and never reads the clock;
+// the ring is allocated when tracing is first enabled.
+class Tracer {
+public:
+    explicit Tracer(size_t capacity = 1 << 16);
+    void enable(bool enabled);
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+    // drops recorded events
+    void set_capacity(size_t capacity);
+    void clear();
+    // events of the following scopes belong to a new request, returns its id
+    int64_t begin_request() { token_ = 0; return ++request_; }
+    int64_t request() const { return request_; }
+    void set_token(int token) { token_ = token; }
+    int64_t now_us() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+    void record(TraceStage stage, int64_t start_us, int64_t dur_us);
+    // oldest first
+    std::vector<TraceEvent> events() const;
+    // total us of every stage of one request or of all when request <= 0, indexed by TraceStage
+    std::vector<int64_t> stage_us(int64_t request = 0) const;
+    // [{"request", "token", "stage", "start_us", "dur_us"}, ...]
+    std::string to_json() const;
+    // trace event format, opens in chrome://tracing and perfetto, one row per request
+    std::string to_chrome_trace() const;
+    // chrome trace unless the path ends with `.jsonl`, then one json event per line
+    bool save(const std::string& path) const;
+private:
+    std::atomic<bool> enabled_ {false};
+    std::chrono::steady_clock::time_point epoch_;
+    std::atomic<int64_t> request_ {0};
+    std::atomic<int> token_ {0};
+    mutable std::mutex mutex_;
+    size_t capacity_;
+    std::vector<TraceEvent> ring_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
+
+// records the scope as one event when the tracer is enabled at construction
+class TraceScope {
+public:
+    TraceScope(Tracer& tracer, TraceStage stage)
+        : tracer_(tracer.enabled() ? &tracer : nullptr), stage_(stage), start_us_(tracer_ ? tracer.now_us() : 0) {}
+    ~TraceScope() {
+        if (tracer_) {
+            tracer_->record(stage_, start_us_, tracer_->now_us() - start_us_);
+        }
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+private:
+    Tracer* tracer_;
+    TraceStage stage_;
+    int64_t start_us_;
+};
+
+#endif // TRACE_hpp
@@ -0,0 +1,65 @@
+//
+//  backend.cpp
+//
+//  Backend factory, the backends of this build are selected by `backend_type` at runtime.
+//
+
+#include <cstring>
+#include <cstdio>
+#include "backend.hpp"
+
+Backend* createMockBackend(const BackendOptions& options);
+#ifdef LLM_BACKEND_NNCASE
+Backend* createNncaseBackend(const BackendOptions& options);
+#endif
+#ifdef LLM_BACKEND_ORT
+Backend* createOrtBackend(const BackendOptions& options);
+#endif
+
+std::string Backend::resolve(const std::string& type) {
+    if (type == "nncase" || type == "k230") {
+        return "nncase";
+    }
+    if (type == "ort" || type == "onnx" || type == "onnxruntime") {
+        return "ort";
+    }
+    if (type == "mock") {
+        return "mock";
+    }
+    // cpu: the default backend of this build
+#ifdef LLM_BACKEND_NNCASE
+    return "nncase";
+#else
+    return "ort";
+#endif
+}
+
+std::shared_ptr<Backend> Backend::create(const std::string& type, const BackendOptions& options) {
+    auto name = resolve(type);
+    Backend* backend = nullptr;
+    if (name == "mock") {
+        backend = createMockBackend(options);
+    }
+#ifdef LLM_BACKEND_NNCASE
+    if (name == "nncase") {
+        backend = createNncaseBackend(options);
+    }
+#endif
+#ifdef LLM_BACKEND_ORT
+    if (name == "ort") {
+        backend = createOrtBackend(options);
+    }
+#endif
+    if (!backend) {
+        printf("Failed: backend `%s` is not built.\n", type.c_str());
+    }
+    return std::shared_ptr<Backend>(backend);
+}
+
+TensorPtr Backend::clone(const TensorPtr& tensor) {
+    auto dest = create_tensor(tensor->dtype(), tensor->shape());
+    ::memcpy(dest->map(MAP_WRITE), tensor->map(MAP_READ), tensor->bytes());
+    tensor->unmap();
+    dest->unmap();
+    return dest;
+}
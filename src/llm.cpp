@@ -7,11 +7,17 @@
 
 #include <iostream>
 #include <fstream>
-#include <nncase/runtime/simple_types.h>
-#include <nncase/runtime/runtime_op_utility.h>
+#include <numeric>
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 #include <unordered_set>
 #include <regex>
+#include <cstring>
+#include <cstdarg>
+#include <random>
+#include <limits>
+#include <filesystem>
 
 #include "llm.hpp"
 #include "llmconfig.hpp"
@@ -27,74 +33,551 @@ std::string Llm::dump_config() {
 }
 
 bool Llm::set_config(const std::string& content) {
-    config_->config_.merge_patch(content.c_str());
+    auto patch = json::parse(content, nullptr, false);
+    if (patch.is_discarded() || !patch.is_object()) {
+        printf("Failed: invalid config patch: %s\n", content.c_str());
+        return false;
+    }
+    config_->config_.merge_patch(patch);
+    if (patch.contains("trace")) {
+        tracer_.enable(config_->trace());
+    }
+    // a new seed restarts sampling from it, < 0 draws one
+    if (patch.contains("seed")) {
+        rng_.seed(config_->seed() >= 0 ? config_->seed() : std::random_device{}());
+    }
     return true;
 }
 
 void Llm::init_runtime() {
-    runtime_manager_.reset(new RuntimeManager());
+    BackendOptions options;
+    options.intra_threads = config_->thread_num();
+    options.inter_threads = config_->inter_thread_num();
+    options.thread_affinity = config_->thread_affinity();
+    options.allow_spinning = config_->power() == "high";
+    options.optimization_level = std::min(std::max(config_->graph_optimization(), 0), 3);
+    options.memory_arena = config_->memory() != "low";
+    options.memory_pattern = config_->memory() != "low";
+    if (!config_->tmp_path().empty()) {
+        options.optimized_model_path = config_->tmp_path() + "/" + file_name(config_->llm_model()) + ".opt";
+    }
+    options.mmz_alloc = config_->mmz_alloc();
+    options.use_mmap = config_->use_mmap();
+    options.mmap_prefetch = config_->mmap_prefetch();
+    options.profile = config_->profile();
+    options.profile_prefix = config_->profile_prefix();
+    options.mock_vocab_size = config_->mock_vocab_size();
+    options.mock_delay_us = config_->mock_delay_us();
+    backend_ = Backend::create(config_->backend_type(), options);
+    if (!backend_) {
+        throw std::runtime_error("no backend for backend_type: " + config_->backend_type());
+    }
 }
 
-void Llm::load() {
-    init_runtime();
+void Llm::init_status() {
     // init module status
     key_value_shape_ = config_->key_value_shape();
     is_single_ = config_->is_single();
     attention_fused_ = config_->attention_fused();
+    rng_.seed(config_->seed() >= 0 ? config_->seed() : std::random_device{}());
+    tracer_.set_capacity(config_->trace_capacity());
+    tracer_.enable(config_->trace());
+    int layer_nums = config_->layer_nums();
+    key_value_shape_.insert(key_value_shape_.begin(), layer_nums);
+    // max context is bounded by the seq dim of kv cache
+    int kv_seq_axis = config_->kv_seq_axis() + 1;
+    if (kv_seq_axis > 0 && kv_seq_axis < static_cast<int>(key_value_shape_.size())) {
+        kv_capacity_ = key_value_shape_[kv_seq_axis];
+        max_context_ = kv_capacity_;
+    }
+    if (config_->max_context() > 0 && (max_context_ <= 0 || config_->max_context() < max_context_)) {
+        max_context_ = config_->max_context();
+    }
+    // kvcache_limit(MB) bounds the tokens held by kv cache
+    if (config_->kvcache_limit() > 0 && kv_capacity_ > 0) {
+        size_t kv_token_bytes = sizeof(float);
+        for (auto dim : key_value_shape_) {
+            kv_token_bytes *= dim;
+        }
+        kv_token_bytes /= kv_capacity_;
+        int budget = static_cast<int>(config_->kvcache_limit() * 1024ll * 1024ll / kv_token_bytes);
+        if (max_context_ <= 0 || budget < max_context_) {
+            load_log("kv cache is limited to %d tokens by kvcache_limit = %d MB\n", budget, config_->kvcache_limit());
+            max_context_ = budget;
+        }
+    }
+}
+
+static int64_t elapsed_us(std::chrono::steady_clock::time_point st) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - st).count();
+}
+
+void Llm::load_log(const char* format, ...) {
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    std::lock_guard<std::mutex> lock(load_log_mutex_);
+    load_log_.emplace_back(buffer);
+}
+
+void Llm::print_load_log() {
+    std::vector<std::string> log;
     {
-        std::ifstream embedding_bin(config_->embedding_file());
-        embedding_bin.close();
+        std::lock_guard<std::mutex> lock(load_log_mutex_);
+        log.swap(load_log_);
     }
-    // 1. load vocab
-    printf("load tokenizer\n");
+    for (auto& line : log) {
+        printf("%s", line.c_str());
+    }
+}
+
+void Llm::load_tokenizer() {
+    auto st = std::chrono::steady_clock::now();
     tokenizer_.reset(Tokenizer::createTokenizer(config_->tokenizer_file()));
-    printf("load tokenizer Done\n");
-    // 3. load model
-    int layer_nums = config_->layer_nums();
-    key_value_shape_.insert(key_value_shape_.begin(), layer_nums);
+    load_stats_.tokenizer_us = elapsed_us(st);
+    load_log("load tokenizer Done! time = %.2f ms\n", load_stats_.tokenizer_us / 1e3);
+}
+
+void Llm::load_embedding() {
+    // the embedding table is mapped, rows are paged in on demand
+    if (config_->load_cold()) {
+        MappedFile::evict(config_->embedding_file());
+    }
+    auto st = std::chrono::steady_clock::now();
+    try {
+        embedding_table_.reset(new MappedFile(config_->embedding_file()));
+    } catch (const std::exception& e) {
+        load_log("Failed: %s, embedding falls back to file read.\n", e.what());
+    }
+    size_t row_bytes = std::max(config_->hidden_size(), 1) * sizeof(int16_t);
+    std::error_code ec;
+    size_t table_bytes = embedding_table_ ? embedding_table_->size() : std::filesystem::file_size(config_->embedding_file(), ec);
+    embedding_rows_ = ec ? 0 : static_cast<int>(std::min<size_t>(table_bytes / row_bytes, std::numeric_limits<int>::max()));
+    load_stats_.embedding_us = elapsed_us(st);
+}
+
+void Llm::load_module() {
     std::string model_path = config_->llm_model();
-    printf("load %s ... ", model_path.c_str());
-    module_.reset(new Module(runtime_manager_, model_path));
-    printf("Load Module Done!\n");
+    if (config_->load_cold()) {
+        MappedFile::evict(model_path);
+    }
+    // share of the model already in page cache, llm_bench times cold and warm loads
+    float resident = MappedFile::resident(model_path);
+    auto st = std::chrono::steady_clock::now();
+    module_ = backend_->load(model_path);
+    if (config_->io_binding()) {
+        module_->bind_kv_cache(key_value_shape_);
+    }
+    // static shape functions exported by the model, prompt is chunked onto them
+    prefill_lens_.clear();
+    for (auto len : config_->prefill_lens()) {
+        if (len > 1 && module_->has_function("prefill_" + std::to_string(len))) {
+            prefill_lens_.push_back(len);
+        }
+    }
+    std::sort(prefill_lens_.begin(), prefill_lens_.end());
+    decode_function_ = module_->has_function("decode");
+    function_.clear();
+    load_stats_.module_us = elapsed_us(st);
+    load_log("load %s Done! [%s] load(%s) time = %.2f ms, resident before load = %.0f%%\n",
+           model_path.c_str(), backend_->name().c_str(), config_->use_mmap() ? "mmap" : "stream",
+           load_stats_.module_us / 1e3, resident * 100);
 }
 
-nncase::tensor Llm::forward(const std::vector<int>& input_ids) {
+void Llm::load_draft() {
+    if (config_->draft_config().empty()) {
+        return;
+    }
+    draft_.reset(Llm::createLLM(config_->draft_config()));
+    // may run on a load_async worker, the draft log is printed with ours
+    draft_->load_components();
+    {
+        std::lock_guard<std::mutex> lock(draft_->load_log_mutex_);
+        for (auto& line : draft_->load_log_) {
+            load_log("draft: %s", line.c_str());
+        }
+        draft_->load_log_.clear();
+    }
+    draft_len_ = 0;
+}
+
+void Llm::load_components() {
+    init_runtime();
+    init_status();
+    // 1. load vocab
+    load_tokenizer();
+    // 2. load embedding
+    load_embedding();
+    // 3. load model
+    load_module();
+    load_draft();
+}
+
+void Llm::load() {
+    auto st = std::chrono::steady_clock::now();
+    load_components();
+    load_stats_.ready_us = elapsed_us(st);
+    print_load_log();
+}
+
+std::future<void> Llm::load_async() {
+    auto st = std::chrono::steady_clock::now();
+    init_runtime();
+    init_status();
+    tokenizer_ready_ = std::async(std::launch::async, [this]() { load_tokenizer(); }).share();
+    return std::async(std::launch::async, [this, st]() {
+        auto embedding = std::async(std::launch::async, [this]() { load_embedding(); });
+        auto draft = std::async(std::launch::async, [this]() { load_draft(); });
+        load_module();
+        draft.get();
+        embedding.get();
+        tokenizer_ready_.get();
+        load_stats_.ready_us = elapsed_us(st);
+        // workers only record their log, it is printed here in one piece
+        print_load_log();
+        printf("load ready: tokenizer = %.2f ms, embedding = %.2f ms, module = %.2f ms, total = %.2f ms\n",
+               load_stats_.tokenizer_us / 1e3, load_stats_.embedding_us / 1e3,
+               load_stats_.module_us / 1e3, load_stats_.ready_us / 1e3);
+    });
+}
+
+bool Llm::context_full() const {
+    return max_context_ > 0 && all_seq_len_ >= max_context_ && !config_->streaming_kv();
+}
+
+int Llm::stream_sink() const {
+    // at least one slot is left for the window, otherwise nothing could be evicted
+    return std::max(std::min({config_->attention_sink(), all_seq_len_, max_context_ - 1}), 0);
+}
+
+int Llm::context_room() const {
+    // streaming prefill chunks evict the middle of the context, a prompt of any length fits;
+    // the glm prompt can't be chunked and has to fit next to the sink in one forward
+    if (max_context_ <= 0 || (config_->streaming_kv() && config_->attention_mask() != "glm")) {
+        return std::numeric_limits<int>::max();
+    }
+    return max_context_ - (config_->streaming_kv() ? stream_sink() : all_seq_len_);
+}
+
+bool Llm::fit_context(std::vector<int>& input_ids) {
+    int room = context_room();
+    if (room == std::numeric_limits<int>::max()) {
+        return true;
+    }
+    // keep one slot for the generated token
+    room -= 1;
+    if (static_cast<int>(input_ids.size()) <= room) {
+        return true;
+    }
+    if (room <= 0 || config_->kvcache_overflow() == "refuse") {
+        printf("Failed: %d prompt tokens exceed the kv cache budget, %d tokens left.\n",
+               static_cast<int>(input_ids.size()), std::max(room, 0));
+        return false;
+    }
+    // truncate, keep the latest tokens
+    input_ids.erase(input_ids.begin(), input_ids.end() - room);
+    return true;
+}
+
+MemoryStats Llm::memory_stats() const {
+    MemoryStats stats;
+    if (module_) {
+        stats.weights = module_->weight_size();
+    }
+    size_t kv_bytes = sizeof(float);
+    for (auto dim : key_value_shape_) {
+        kv_bytes *= dim;
+    }
+    if (past_key_values_) {
+        stats.kv_allocated = kv_bytes;
+        if (kv_capacity_ > 0) {
+            stats.kv_used = kv_bytes / kv_capacity_ * all_seq_len_;
+        }
+    }
+    stats.inputs = input_bytes_;
+    if (tokenizer_) {
+        stats.tokenizer = tokenizer_->memory_usage();
+    }
+    if (embedding_table_) {
+        stats.embedding = embedding_table_->size();
+    }
+    return stats;
+}
+
+TensorPtr Llm::forward(const std::vector<int>& input_ids, bool prefill) {
     int seq_len = input_ids.size();
-    std::vector<nncase::value_t> inputs;
-    inputs.emplace_back(embedding(input_ids));
-    inputs.emplace_back(gen_attention_mask(seq_len));
-    inputs.emplace_back(gen_position_ids(seq_len));
+    // a 1 token prompt chunk still takes the prefill mask, positions and function
+    bool decode = seq_len == 1 && !prefill;
+    if (max_context_ > 0 && all_seq_len_ + seq_len > max_context_ && config_->streaming_kv()) {
+        evict_kv(seq_len);
+    }
+    std::string function;
+    if (decode && decode_function_) {
+        function = "decode";
+    } else if (std::binary_search(prefill_lens_.begin(), prefill_lens_.end(), seq_len)) {
+        function = "prefill_" + std::to_string(seq_len);
+    }
+    if (function != function_) {
+        module_->select_function(function);
+        function_ = function;
+    }
+    tracer_.set_token(gen_seq_len_);
+    std::vector<TensorPtr> inputs;
+    {
+        TraceScope scope(tracer_, TraceStage::Embedding);
+        inputs.emplace_back(embedding(input_ids));
+    }
+    {
+        TraceScope scope(tracer_, TraceStage::Mask);
+        inputs.emplace_back(gen_attention_mask(seq_len, decode));
+    }
+    {
+        TraceScope scope(tracer_, TraceStage::Position);
+        inputs.emplace_back(gen_position_ids(seq_len, decode));
+    }
+    input_bytes_ = 0;
+    for (auto& input : inputs) {
+        input_bytes_ += input->bytes();
+    }
     inputs.emplace_back(std::move(past_key_values_));
-    auto outputs = module_->onForward(inputs);
-    auto logits = outputs->fields()[0].as<nncase::tensor>().unwrap_or_throw();
-    past_key_values_ = std::move(outputs->fields()[1]);
+    std::vector<TensorPtr> outputs;
+    {
+        TraceScope scope(tracer_, TraceStage::Invoke);
+        module_->set_kv_rows(config_->kv_seq_axis() + 1, all_seq_len_, seq_len);
+        outputs = module_->forward(inputs);
+    }
+    auto logits = outputs[0];
+    past_key_values_ = outputs[1];
     all_seq_len_ += seq_len;
     gen_seq_len_++;
     return logits;
 }
 
-int Llm::sample(nncase::tensor& logits, const std::vector<int>& pre_ids) {
+TensorPtr Llm::prefill_step(const std::vector<int>& input_ids, int& pos) {
+    int chunk = static_cast<int>(input_ids.size()) - pos;
+    // glm prefix mask and positions span the whole prompt, it can't be split; glm2 is causal and
+    // chunks like the others, a 1 token chunk is forwarded as prefill so it keeps prompt positions
+    if (config_->prefill_chunk() > 0 && config_->attention_mask() != "glm") {
+        chunk = std::min(chunk, config_->prefill_chunk());
+    }
+    // streaming evicts down to the sink before a forward, a longer chunk would overrun the kv cache
+    if (max_context_ > 0 && config_->streaming_kv() && config_->attention_mask() != "glm") {
+        chunk = std::min(chunk, max_context_ - stream_sink());
+    }
+    // chunk onto the largest fitting specialization instead of padding, padded tokens would
+    // shift the last token logits; the tail shorter than every specialization runs dynamic
+    // stop before input that isn't ready yet, e.g. an image still decoding, it overlaps this chunk
+    int ready = ready_len(input_ids, pos);
+    if (ready > 0) {
+        chunk = std::min(chunk, ready);
+    }
+    auto iter = std::upper_bound(prefill_lens_.begin(), prefill_lens_.end(), chunk);
+    if (iter != prefill_lens_.begin()) {
+        chunk = *(iter - 1);
+    }
+    // mask and positions follow all_seq_len_, every chunk appends to the kv cache
+    int gen_seq_len = gen_seq_len_;
+    auto logits = forward(std::vector<int>(input_ids.begin() + pos, input_ids.begin() + pos + chunk), true);
+    // the whole prompt counts as one step
+    gen_seq_len_ = gen_seq_len + (pos == 0);
+    pos += chunk;
+    return logits;
+}
+
+TensorPtr Llm::prefill(const std::vector<int>& input_ids) {
+    if (input_ids.empty()) {
+        return forward(input_ids);
+    }
+    TensorPtr logits;
+    for (int pos = 0; pos < static_cast<int>(input_ids.size());) {
+        logits = prefill_step(input_ids, pos);
+    }
+    return logits;
+}
+
+bool Llm::batch_enabled() const {
+    return config_->max_batch() > 1 && config_->kv_batch_axis() >= 0;
+}
+
+TensorPtr Llm::new_kv_cache(int batch) {
+    auto shape = key_value_shape_;
+    if (batch > 1) {
+        shape[config_->kv_batch_axis() + 1] = batch;
+    }
+    auto kv = _Input<float>(shape, backend_);
+    ::memset(kv->map(MAP_WRITE), 0, kv->bytes());
+    kv->unmap();
+    return kv;
+}
+
+void Llm::copy_kv_slot(const TensorPtr& src, const TensorPtr& dst, int slot) {
+    // src is a batch 1 kv cache, dst holds `batch` slots on kv_batch_axis
+    int axis = config_->kv_batch_axis() + 1;
+    int batch = dst->shape()[axis];
+    size_t outer = 1;
+    for (int i = 0; i < axis; i++) {
+        outer *= src->shape()[i];
+    }
+    size_t inner_bytes = src->bytes() / outer;
+    auto src_ptr = src->map<char>(MAP_READ);
+    auto dst_ptr = dst->map<char>(MAP_READ_WRITE);
+    for (size_t o = 0; o < outer; o++) {
+        ::memcpy(dst_ptr + (o * batch + slot) * inner_bytes, src_ptr + o * inner_bytes, inner_bytes);
+    }
+    src->unmap();
+    dst->unmap();
+}
+
+TensorPtr Llm::forward_batch(const std::vector<int>& tokens, const std::vector<int>& positions, TensorPtr& past_key_values) {
+    // batch export: inputs_embeds [1, batch, hidden], attention_mask [batch, 1, 1, kv capacity],
+    // position_ids [batch, 1]; every slot attends to its own prefix of the shared kv cache
+    int batch = static_cast<int>(tokens.size());
+    int hidden_size = config_->hidden_size();
+    auto embeds = embedding(tokens);
+    auto inputs_embeds = _Input<float>({1, batch, hidden_size}, backend_);
+    ::memcpy(inputs_embeds->map(MAP_WRITE), embeds->map(MAP_READ), inputs_embeds->bytes());
+    embeds->unmap();
+    inputs_embeds->unmap();
+    bool float_mask = config_->attention_mask() == "float";
+    auto attention_mask = float_mask ? _Input<float>({batch, 1, 1, kv_capacity_}, backend_)
+                                     : _Input<int>({batch, 1, 1, kv_capacity_}, backend_);
+    {
+        auto ptr = attention_mask->map(MAP_WRITE);
+        for (int b = 0; b < batch; b++) {
+            for (int j = 0; j < kv_capacity_; j++) {
+                bool visible = j <= positions[b];
+                if (float_mask) {
+                    reinterpret_cast<float*>(ptr)[b * kv_capacity_ + j] = visible ? 0.f : std::numeric_limits<float>::lowest();
+                } else {
+                    reinterpret_cast<int*>(ptr)[b * kv_capacity_ + j] = visible;
+                }
+            }
+        }
+    }
+    attention_mask->unmap();
+    auto position_ids = _Input<int>({batch, 1}, backend_);
+    {
+        auto ptr = position_ids->map<int>(MAP_WRITE);
+        for (int b = 0; b < batch; b++) {
+            ptr[b] = std::max(positions[b], 0);
+        }
+    }
+    position_ids->unmap();
+    // a batch export may live next to the batch 1 functions as `batch`
+    std::string function = module_->has_function("batch") ? "batch" : "";
+    if (function != function_) {
+        module_->select_function(function);
+        function_ = function;
+    }
+    auto outputs = module_->forward({inputs_embeds, attention_mask, position_ids, past_key_values});
+    past_key_values = outputs[1];
+    return outputs[0];
+}
+
+void Llm::evict_kv(int seq_len) {
+    // StreamingLLM: keep the first `attention_sink` tokens and a recent window, evict the middle
+    int axis = config_->kv_seq_axis() + 1;
+    int capacity = key_value_shape_[axis];
+    // rows past the capacity were never written, only what the tensor holds is moved
+    int len = std::min(all_seq_len_, capacity);
+    int sink = std::min(stream_sink(), len);
+    int window = max_context_ - sink - seq_len;
+    if (config_->sliding_window() > 0) {
+        window = std::min(window, config_->sliding_window());
+    }
+    window = std::max(0, std::min(window, len - sink));
+    int evict = all_seq_len_ - sink - window;
+    if (evict <= 0 || !past_key_values_) {
+        return;
+    }
+    {
+        auto kv_ptr = past_key_values_->map<char>(MAP_READ_WRITE);
+        // kv layout: [outer..., seq, inner...], compact every outer slice
+        size_t outer = 1;
+        for (int i = 0; i < axis; i++) {
+            outer *= key_value_shape_[i];
+        }
+        size_t inner_bytes = past_key_values_->bytes() / (outer * capacity);
+        for (size_t o = 0; o < outer; o++) {
+            auto base = kv_ptr + o * capacity * inner_bytes;
+            ::memmove(base + sink * inner_bytes, base + (len - window) * inner_bytes, window * inner_bytes);
+        }
+    }
+    past_key_values_->unmap();
+    all_seq_len_ -= evict;
+    evicted_len_ += evict;
+}
+
+int Llm::sample(TensorPtr& logits, const std::vector<int>& pre_ids) {
+    // logits of the last position or of every position, sample the last row
+    int vocab = logits->shape().back();
+    auto scores = logits->map<float>(MAP_READ_WRITE) + logits->elements() - vocab;
+    int token_id = sample(scores, vocab, pre_ids);
+    logits->unmap();
+    return token_id;
+}
+
+int Llm::sample(float* scores, int size, const std::vector<int>& pre_ids) {
+    TraceScope scope(tracer_, TraceStage::Sample);
     std::unordered_set<int> ids_set(pre_ids.begin(), pre_ids.end());
-    auto logits_buffer = logits->buffer().as_host().unwrap_or_throw();
-    auto logits_mapped = logits_buffer.map(nncase::runtime::map_read).unwrap_or_throw();
-    auto scores = logits_mapped.buffer().as_span<float>();
-    auto shape = logits->shape();
-    auto size = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int64_t>());
-    // repetition penalty
+    // repetition penalty, origin scores are restored after sample so logits can be sampled again
     const float repetition_penalty = 1.1;
+    std::vector<std::pair<int, float>> origin_scores;
+    origin_scores.reserve(ids_set.size());
     for (auto id : ids_set) {
         float score = scores[id];
+        origin_scores.emplace_back(id, score);
         scores[id] = score < 0 ? score * repetition_penalty : score / repetition_penalty;
     }
-    // argmax
-    float max_score = 0;
     int token_id = 0;
-    for (int i = 0; i < size; i++) {
-        float score = scores[i];
-        if (score > max_score) {
-            max_score = score;
-            token_id = i;
+    float temperature = config_->temperature();
+    if (temperature <= 0.f) {
+        // argmax
+        float max_score = std::numeric_limits<float>::lowest();
+        for (int i = 0; i < size; i++) {
+            float score = scores[i];
+            if (score > max_score) {
+                max_score = score;
+                token_id = i;
+            }
+        }
+    } else {
+        // top-k, top-p sampling with temperature
+        int top_k = config_->top_k();
+        if (top_k <= 0 || top_k > size) { top_k = size; }
+        std::vector<std::pair<float, int>> candidates(size);
+        for (int i = 0; i < size; i++) {
+            candidates[i] = {scores[i], i};
+        }
+        std::partial_sort(candidates.begin(), candidates.begin() + top_k, candidates.end(),
+                          [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; });
+        candidates.resize(top_k);
+        float max_score = candidates[0].first, sum = 0.f;
+        for (auto& c : candidates) {
+            c.first = std::exp((c.first - max_score) / temperature);
+            sum += c.first;
+        }
+        float top_p = config_->top_p(), cumulative = 0.f;
+        size_t keep = 0;
+        while (keep < candidates.size()) {
+            cumulative += candidates[keep++].first / sum;
+            if (cumulative >= top_p) { break; }
         }
+        std::uniform_real_distribution<float> dist(0.f, cumulative * sum);
+        float r = dist(rng_);
+        token_id = candidates[keep - 1].second;
+        for (size_t i = 0; i < keep; i++) {
+            r -= candidates[i].first;
+            if (r <= 0.f) {
+                token_id = candidates[i].second;
+                break;
+            }
+        }
+    }
+    for (auto& score : origin_scores) {
+        scores[score.first] = score.second;
     }
     return token_id;
 }
@@ -148,10 +631,8 @@ std::string Llm::apply_chat_template(const std::vector<PromptItem>& chat_prompts
 }
 
 void Llm::chat() {
-
+    Conversation conversation(this);
     while (true) {
-        std::vector<PromptItem> history;
-        history.push_back(std::make_pair("system", "You are a helpful assistant."));
         std::cout << "\nQ: ";
         std::string user_str;
         std::getline(std::cin, user_str);
@@ -159,87 +640,554 @@ void Llm::chat() {
             break;
         }
         if (user_str == "/reset") {
-            history.resize(1);
+            conversation.reset();
             std::cout << "\nA: reset done." << std::endl;
             continue;
         }
         std::cout << "\nA: " << std::flush;
-        history.emplace_back(std::make_pair("user", user_str));
-        auto assistant_str = response(history);
-        history.emplace_back(std::make_pair("assistant", assistant_str));
+        conversation.response(user_str);
         std::cout << std::endl;
-        reset();
     }
 }
 
 void Llm::reset() {
     history_ids_.clear();
     all_seq_len_ = 0;
+    evicted_len_ = 0;
+    past_key_values_ = nullptr;
 }
 
 void Llm::generate_init() {
+    generate_init(config_->reuse_kv());
+}
+
+void Llm::generate_init(bool keep_context) {
     // init status
     gen_seq_len_ = 0;
+    tracer_.begin_request();
     prefill_us_ = 0;
     decode_us_ = 0;
-    past_key_values_ = _Input<float>(key_value_shape_, runtime_manager_);
-    if (!config_->reuse_kv()) {
+    spec_stats_ = SpeculativeStats();
+    ngram_index_.clear();
+    ngram_indexed_ = 0;
+    if (!keep_context) {
+        reset();
+    }
+    // kv cache is only allocated for a fresh context, otherwise continue on it
+    if (all_seq_len_ == 0 || !past_key_values_) {
+        past_key_values_ = new_kv_cache();
         all_seq_len_ = 0;
+        evicted_len_ = 0;
         history_ids_.clear();
+        if (draft_) {
+            draft_->generate_init(false);
+        }
+        draft_len_ = 0;
+    }
+}
+
+bool Llm::save_session(const std::string& path) const {
+    if (!past_key_values_) {
+        printf("Failed: no context to save.\n");
+        return false;
+    }
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs.is_open()) {
+        printf("Failed: can't open %s\n", path.c_str());
+        return false;
+    }
+    // magic, lengths, history ids, kv shape, kv data
+    const uint32_t magic = 0x534d4c4c; // LLMS
+    auto write = [&ofs](const void* data, size_t size) { ofs.write(reinterpret_cast<const char*>(data), size); };
+    int header[4] = {all_seq_len_, evicted_len_, static_cast<int>(history_ids_.size()),
+                     static_cast<int>(past_key_values_->shape().size())};
+    write(&magic, sizeof(magic));
+    write(header, sizeof(header));
+    write(history_ids_.data(), history_ids_.size() * sizeof(int));
+    write(past_key_values_->shape().data(), past_key_values_->shape().size() * sizeof(int));
+    write(past_key_values_->map(MAP_READ), past_key_values_->bytes());
+    past_key_values_->unmap();
+    return ofs.good();
+}
+
+bool Llm::load_session(const std::string& path) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    size_t file_size = ifs ? static_cast<size_t>(ifs.tellg()) : 0;
+    ifs.seekg(0);
+    auto read = [&ifs](void* data, size_t size) { return static_cast<bool>(ifs.read(reinterpret_cast<char*>(data), size)); };
+    uint32_t magic = 0;
+    int header[4] = {0};
+    if (!read(&magic, sizeof(magic)) || magic != 0x534d4c4c || !read(header, sizeof(header))) {
+        printf("Failed: %s is not a session file.\n", path.c_str());
+        return false;
+    }
+    // sizes come from the file, they are checked before anything is allocated
+    int all_seq_len = header[0], evicted_len = header[1], history_len = header[2], dims = header[3];
+    if (all_seq_len < 0 || evicted_len < 0 || history_len < 0 ||
+        static_cast<size_t>(history_len) > file_size / sizeof(int) || dims != static_cast<int>(key_value_shape_.size())) {
+        printf("Failed: %s has a corrupt header.\n", path.c_str());
+        return false;
+    }
+    std::vector<int> history(history_len), shape(dims);
+    if (!read(history.data(), history.size() * sizeof(int)) || !read(shape.data(), shape.size() * sizeof(int))) {
+        printf("Failed: %s is truncated.\n", path.c_str());
+        return false;
+    }
+    if (shape != key_value_shape_) {
+        printf("Failed: session kv shape doesn't match the model.\n");
+        return false;
+    }
+    int context = max_context_ > 0 ? max_context_ : kv_capacity_;
+    if (context > 0 && all_seq_len > context) {
+        printf("Failed: session holds %d tokens, the context is %d.\n", all_seq_len, context);
+        return false;
+    }
+    auto kv = new_kv_cache();
+    bool ok = read(kv->map(MAP_WRITE), kv->bytes());
+    kv->unmap();
+    if (!ok) {
+        printf("Failed: %s is truncated.\n", path.c_str());
+        return false;
+    }
+    past_key_values_ = kv;
+    all_seq_len_ = all_seq_len;
+    evicted_len_ = evicted_len;
+    history_ids_ = std::move(history);
+    if (draft_) {
+        draft_->generate_init(false);
+    }
+    draft_len_ = 0;
+    return true;
+}
+
+void Llm::rollback(int tokens) {
+    // stale kv entries past all_seq_len_ are masked out and overwritten by the next forward
+    all_seq_len_ -= std::min(std::max(tokens, 0), all_seq_len_);
+}
+
+std::vector<int> Llm::propose(const std::vector<int>& ids, int k) {
+    // draft kv holds ids[0, draft_len_), catch up on the rest then draft k tokens greedily
+    if (draft_len_ > static_cast<int>(ids.size())) {
+        draft_->generate_init(false);
+        draft_len_ = 0;
+    }
+    std::vector<int> pending(ids.begin() + draft_len_, ids.end());
+    if (draft_->max_context_ > 0 && draft_->all_seq_len_ + static_cast<int>(pending.size()) + k > draft_->max_context_ &&
+        !draft_->config_->streaming_kv()) {
+        return {};
+    }
+    std::vector<int> draft;
+    auto logits = draft_->prefill(pending);
+    draft.push_back(draft_->sample(logits, ids));
+    for (int i = 1; i < k; i++) {
+        logits = draft_->forward({draft.back()});
+        draft.push_back(draft_->sample(logits, ids));
+    }
+    draft_len_ = static_cast<int>(ids.size()) + k - 1;
+    return draft;
+}
+
+static uint64_t ngram_hash(const int* ids, int n) {
+    // FNV-1a over token ids
+    uint64_t hash = 1469598103934665603ull;
+    for (int i = 0; i < n; i++) {
+        hash = (hash ^ static_cast<uint32_t>(ids[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::vector<int> Llm::lookup(const std::vector<int>& ids, int k) {
+    // prompt lookup: find the latest earlier occurrence of the last n ids and propose what followed it
+    int n = config_->lookup_ngram();
+    int size = static_cast<int>(ids.size());
+    if (size <= n) {
+        return {};
+    }
+    // index every n-gram that has a continuation, the newest occurrence wins
+    for (int end = std::max(ngram_indexed_, n); end < size; end++) {
+        ngram_index_[ngram_hash(ids.data() + end - n, n)] = end;
+    }
+    ngram_indexed_ = size;
+    auto iter = ngram_index_.find(ngram_hash(ids.data() + size - n, n));
+    if (iter == ngram_index_.end() || iter->second >= size) {
+        return {};
+    }
+    int start = iter->second;
+    if (!std::equal(ids.begin() + start - n, ids.begin() + start, ids.end() - n)) {
+        return {};
+    }
+    return std::vector<int>(ids.begin() + start, ids.begin() + std::min(start + k, size));
+}
+
+std::vector<int> Llm::verify(int token, const std::vector<int>& draft, std::vector<int>& ids, int max_tokens) {
+    // token and draft in one forward, row i of logits predicts the token after input i
+    std::vector<int> input_ids(1, token);
+    input_ids.insert(input_ids.end(), draft.begin(), draft.end());
+    int n = static_cast<int>(input_ids.size());
+    int gen_seq_len = gen_seq_len_;
+    auto st = std::chrono::steady_clock::now();
+    auto logits = forward(input_ids);
+    spec_stats_.verify_us += elapsed_us(st);
+    int vocab = logits->shape().back();
+    if (static_cast<int>(logits->elements()) != n * vocab) {
+        printf("Failed: speculative decoding needs logits of every position, model only returns the last one.\n");
+        speculative_ = false;
+        rollback(n);
+        gen_seq_len_ = gen_seq_len;
+        logits = forward({token});
+        return {sample(logits, ids)};
+    }
+    auto scores = logits->map<float>(MAP_READ_WRITE);
+    std::vector<int> accepted;
+    for (int i = 0; i < n; i++) {
+        int next = sample(scores + i * vocab, vocab, ids);
+        accepted.push_back(next);
+        bool match = i < static_cast<int>(draft.size()) && next == draft[i];
+        if (!match || is_stop(next) || static_cast<int>(accepted.size()) >= max_tokens) {
+            break;
+        }
+        // matched draft token is already in kv cache
+        ids.push_back(next);
+    }
+    logits->unmap();
+    // keep token and the matched draft tokens
+    int keep = static_cast<int>(accepted.size());
+    rollback(n - keep);
+    gen_seq_len_ = gen_seq_len + keep;
+    if (draft_) {
+        int matched = std::min(keep - 1, static_cast<int>(draft.size()) - 1);
+        draft_->rollback(static_cast<int>(draft.size()) - 1 - matched);
+        draft_len_ -= static_cast<int>(draft.size()) - 1 - matched;
+    }
+    spec_stats_.rounds++;
+    spec_stats_.proposed += static_cast<int>(draft.size());
+    spec_stats_.accepted += keep - 1;
+    spec_stats_.tokens += keep;
+    return accepted;
+}
+
+std::vector<int> Llm::decode_step(int token, std::vector<int>& ids, int max_tokens) {
+    ids.push_back(token);
+    int k = std::min(config_->draft_tokens(), max_tokens - 1);
+    if (max_context_ > 0) {
+        // verify forwards k + 1 tokens, in streaming mode they must fit next to the sink
+        k = std::min(k, config_->streaming_kv() ? max_context_ - stream_sink() - 1 : max_context_ - all_seq_len_ - 1);
+    }
+    if (speculative_ && (draft_ || config_->lookup_ngram() > 0) && k > 0) {
+        auto st = std::chrono::steady_clock::now();
+        auto draft = draft_ ? propose(ids, k) : lookup(ids, k);
+        if (!draft.empty()) {
+            auto accepted = verify(token, draft, ids, max_tokens);
+            spec_stats_.us += elapsed_us(st);
+            return accepted;
+        }
+    }
+    auto logits = forward({token});
+    return {sample(logits, ids)};
+}
+
+std::string Llm::turn_end() const {
+    // the text after content in chat template, eg: `<|im_end|>\n` for qwen;
+    // stop token is never forwarded, so a continued turn must feed it first
+    auto chat_template = config_->chat_template();
+    const std::string placeholder = "%s";
+    size_t pos = chat_template.find(placeholder);
+    if (pos == std::string::npos) {
+        return "";
     }
+    return chat_template.substr(pos + placeholder.length());
 }
 
-std::vector<int> Llm::generate(const std::vector<int>& input_ids, int max_new_tokens) {
+std::vector<int> Llm::generate(const std::vector<int>& prompt_ids, int max_new_tokens) {
     generate_init();
+    auto input_ids = prompt_ids;
+    if (!fit_context(input_ids)) {
+        return {};
+    }
     std::vector<int> output_ids, all_ids = input_ids;
     prompt_len_ = static_cast<int>(input_ids.size());
     if (max_new_tokens < 0) { max_new_tokens = config_->max_new_tokens(); }
     // prefill
-    auto logits = forward(input_ids);
+    auto logits = prefill(input_ids);
     int token = sample(logits, all_ids);
     output_ids.push_back(token);
-    all_ids.push_back(token);
     // decode
-    while (gen_seq_len_ < max_new_tokens) {
-        logits = forward({token});
-        token = sample(logits, all_ids);
-        if (is_stop(token)) { break; }
-        output_ids.push_back(token);
-        all_ids.push_back(token);
+    bool stop = false;
+    while (!stop && gen_seq_len_ < max_new_tokens && !context_full()) {
+        auto tokens = decode_step(token, all_ids, max_new_tokens - gen_seq_len_);
+        for (auto id : tokens) {
+            if ((stop = is_stop(id))) { break; }
+            output_ids.push_back(id);
+        }
+        token = tokens.back();
     }
     return output_ids;
 }
 
-std::string Llm::generate(const std::vector<int>& input_ids, std::ostream* os, const char* end_with) {
+const char* finish_reason_name(FinishReason reason) {
+    switch (reason) {
+        case FinishReason::Stop: return "stop";
+        case FinishReason::StopString: return "stop_string";
+        case FinishReason::Length: return "length";
+        case FinishReason::ContextFull: return "context_full";
+        case FinishReason::Cancelled: return "cancelled";
+        case FinishReason::Deadline: return "deadline";
+        default: return "none";
+    }
+}
+
+std::string Llm::generate(const std::vector<int>& prompt_ids, std::ostream* os, const char* end_with) {
+    GenerationControl control;
+    control.max_new_tokens = std::max(config_->max_new_tokens() - static_cast<int>(prompt_ids.size()), 1);
+    auto result = generate(prompt_ids, control, os);
+    if (result.finish_reason == FinishReason::Stop) {
+        *os << end_with << std::flush;
+    }
+#ifdef DUMP_PROFILE_INFO
+    print_speed();
+#endif
+    return result.text;
+}
+
+GenerationResult Llm::generate(const std::vector<int>& prompt_ids, GenerationControl& control, std::ostream* os) {
+    GenerationResult result;
+    auto start = std::chrono::steady_clock::now();
+    auto input_ids = prompt_ids;
+    if (!fit_context(input_ids)) {
+        result.finish_reason = FinishReason::ContextFull;
+        return result;
+    }
+    // nothing to prefill, there are no logits to sample from
+    if (input_ids.empty()) {
+        printf("Failed: generate needs at least one prompt token.\n");
+        return result;
+    }
     prompt_len_ = static_cast<int>(input_ids.size());
+    result.prompt_tokens = prompt_len_;
     history_ids_.insert(history_ids_.end(), input_ids.begin(), input_ids.end()); // push to history_ids_
-    auto st = std::chrono::system_clock::now();
-    auto logits = forward(input_ids);
-    int token = sample(logits, history_ids_);
-    auto et = std::chrono::system_clock::now();
-    std::string output_str = decode(token);
-    prefill_us_ = std::chrono::duration_cast<std::chrono::microseconds>(et - st).count();
-    *os << output_str << std::flush;
-    while ((prompt_len_ + gen_seq_len_) < config_->max_new_tokens())
-    {
-        st = std::chrono::system_clock::now();
-        history_ids_.push_back(token);
-        logits = forward({token});
-        token = sample(logits, history_ids_);
-        et = std::chrono::system_clock::now();
-        decode_us_ += std::chrono::duration_cast<std::chrono::microseconds>(et - st).count();
-        if (is_stop(token)) {
-            *os << end_with << std::flush;
+    int budget = control.max_new_tokens > 0 ? control.max_new_tokens : config_->max_new_tokens();
+    // text held back from the stream while it may still turn into a stop string
+    size_t emitted = 0;
+    auto emit = [&](size_t end) {
+        if (os && end > emitted) {
+            os->write(result.text.data() + emitted, end - emitted);
+            os->flush();
+        }
+        emitted = std::max(emitted, end);
+    };
+    // on_token gets views into result.text, `token_batch` ids per call
+    size_t notified = 0;
+    int64_t notified_us = 0;
+    int token_batch = std::max(control.token_batch, 1);
+    std::vector<int> batch_ids;
+    batch_ids.reserve(token_batch);
+    auto notify = [&](bool force) {
+        if (!control.on_token || batch_ids.empty() || (!force && static_cast<int>(batch_ids.size()) < token_batch)) {
+            return;
+        }
+        TokenStats stats;
+        stats.count = static_cast<int>(batch_ids.size());
+        stats.index = static_cast<int>(result.ids.size()) - stats.count;
+        stats.ids = batch_ids.data();
+        stats.ttft_us = result.ttft_us;
+        stats.elapsed_us = result.token_us.back();
+        stats.latency_us = stats.elapsed_us - notified_us;
+        control.on_token(batch_ids.back(), std::string_view(result.text).substr(notified, emitted - notified), stats);
+        notified = emitted;
+        notified_us = stats.elapsed_us;
+        batch_ids.clear();
+    };
+    auto append = [&](int id) {
+        result.ids.push_back(id);
+        result.token_us.push_back(elapsed_us(start));
+        batch_ids.push_back(id);
+        decode(id, result.text);
+        size_t hold = 0, matched = std::string::npos;
+        for (auto& stop : control.stop_strings) {
+            if (stop.empty()) {
+                continue;
+            }
+            size_t pos = result.text.find(stop, emitted > stop.size() ? emitted - stop.size() : 0);
+            if (pos != std::string::npos) {
+                matched = std::min(matched, pos);
+                continue;
+            }
+            for (size_t n = std::min(stop.size() - 1, result.text.size()); n > hold; n--) {
+                if (result.text.compare(result.text.size() - n, n, stop, 0, n) == 0) {
+                    hold = n;
+                    break;
+                }
+            }
+        }
+        if (matched != std::string::npos) {
+            result.text.resize(matched);
+            emit(matched);
+            return false;
+        }
+        emit(result.text.size() - hold);
+        notify(false);
+        return true;
+    };
+    auto interrupted = [&]() {
+        if (control.cancelled) {
+            result.finish_reason = FinishReason::Cancelled;
+        } else if (std::chrono::steady_clock::now() >= control.deadline) {
+            result.finish_reason = FinishReason::Deadline;
+        }
+        return result.finish_reason != FinishReason::None;
+    };
+    // prefill chunk by chunk, a cancel lands between chunks
+    TensorPtr logits;
+    int64_t trace_start = tracer_.enabled() ? tracer_.now_us() : 0;
+    for (int pos = 0; pos < prompt_len_;) {
+        if (interrupted()) {
+            return result;
+        }
+        logits = prefill_step(input_ids, pos);
+    }
+    std::vector<int> tokens(1, sample(logits, history_ids_));
+    if (tracer_.enabled()) {
+        tracer_.set_token(0);
+        tracer_.record(TraceStage::Prefill, trace_start, tracer_.now_us() - trace_start);
+    }
+    prefill_us_ = elapsed_us(start);
+    result.ttft_us = prefill_us_;
+    while (true) {
+        for (auto id : tokens) {
+            if (is_stop(id)) {
+                result.finish_reason = FinishReason::Stop;
+                break;
+            }
+            if (!append(id)) {
+                result.finish_reason = FinishReason::StopString;
+                break;
+            }
+            if (static_cast<int>(result.ids.size()) >= budget) {
+                result.finish_reason = FinishReason::Length;
+                break;
+            }
+        }
+        if (result.finish_reason != FinishReason::None || interrupted()) {
             break;
         }
-        auto word = decode(token);
-        *os << word << std::flush;
-        output_str += word;
+        if (context_full()) {
+            result.finish_reason = FinishReason::ContextFull;
+            break;
+        }
+        auto st = std::chrono::steady_clock::now();
+        {
+            TraceScope scope(tracer_, TraceStage::Decode);
+            tokens = decode_step(tokens.back(), history_ids_, budget - static_cast<int>(result.ids.size()));
+        }
+        decode_us_ += elapsed_us(st);
     }
-#ifdef DUMP_PROFILE_INFO
-    print_speed();
-#endif
-    return output_str;
+    if (result.finish_reason != FinishReason::StopString) {
+        emit(result.text.size());
+    }
+    notify(true);
+    result.completion_tokens = static_cast<int>(result.ids.size());
+    result.total_us = elapsed_us(start);
+    return result;
+}
+
+std::vector<std::string> Llm::generate_n(const std::string& prompt, int n) {
+    // prefill once, then decode n branches interleaved on the module
+    struct Branch {
+        TensorPtr past_key_values;
+        int all_seq_len, evicted_len, gen_seq_len;
+        std::vector<int> ids;
+        int token;
+        std::string text;
+        bool done = false;
+        std::mt19937 rng;
+    };
+    generate_init(false);
+    auto input_ids = tokenizer(prompt);
+    if (!fit_context(input_ids)) {
+        return std::vector<std::string>(n);
+    }
+    // greedy branches are identical, one is decoded for all of them
+    int branch_num = config_->temperature() > 0.f ? n : std::min(n, 1);
+    prompt_len_ = static_cast<int>(input_ids.size());
+    auto st = std::chrono::steady_clock::now();
+    auto logits = prefill(input_ids);
+    prefill_us_ = elapsed_us(st);
+    // the prefix kv is shared by every branch until it forwards; the module may write present in place
+    // and streaming evicts in place, so a branch clones the kv while a sibling still holds it
+    std::vector<Branch> branches(branch_num);
+    int alive = 0;
+    for (auto& branch : branches) {
+        branch.past_key_values = past_key_values_;
+        branch.all_seq_len = all_seq_len_;
+        branch.evicted_len = evicted_len_;
+        branch.gen_seq_len = gen_seq_len_;
+        branch.ids = input_ids;
+        // every branch samples its own sequence
+        branch.rng.seed(rng_());
+        std::swap(rng_, branch.rng);
+        branch.token = sample(logits, branch.ids);
+        std::swap(rng_, branch.rng);
+        branch.done = is_stop(branch.token);
+        if (branch.done) {
+            branch.past_key_values.reset();
+        } else {
+            branch.text = decode(branch.token);
+            alive++;
+        }
+    }
+    past_key_values_.reset();
+    st = std::chrono::steady_clock::now();
+    while (alive > 0) {
+        for (auto& branch : branches) {
+            if (branch.done) {
+                continue;
+            }
+            if ((prompt_len_ + branch.gen_seq_len) >= config_->max_new_tokens() ||
+                (max_context_ > 0 && branch.all_seq_len >= max_context_ && !config_->streaming_kv())) {
+                branch.done = true;
+                branch.past_key_values.reset();
+                alive--;
+                continue;
+            }
+            // swap branch state in
+            if (branch.past_key_values.use_count() > 1) {
+                branch.past_key_values = backend_->clone(branch.past_key_values);
+            }
+            past_key_values_ = std::move(branch.past_key_values);
+            all_seq_len_ = branch.all_seq_len;
+            evicted_len_ = branch.evicted_len;
+            gen_seq_len_ = branch.gen_seq_len;
+            branch.ids.push_back(branch.token);
+            logits = forward({branch.token});
+            std::swap(rng_, branch.rng);
+            branch.token = sample(logits, branch.ids);
+            std::swap(rng_, branch.rng);
+            // swap branch state out
+            branch.past_key_values = std::move(past_key_values_);
+            branch.all_seq_len = all_seq_len_;
+            branch.evicted_len = evicted_len_;
+            branch.gen_seq_len = gen_seq_len_;
+            if (is_stop(branch.token)) {
+                branch.done = true;
+                branch.past_key_values.reset();
+                alive--;
+                continue;
+            }
+            branch.text += decode(branch.token);
+        }
+    }
+    decode_us_ = elapsed_us(st);
+    gen_seq_len_ = 0;
+    std::vector<std::string> outputs;
+    for (auto& branch : branches) {
+        gen_seq_len_ += branch.gen_seq_len;
+        outputs.emplace_back(std::move(branch.text));
+    }
+    std::string first = outputs.empty() ? "" : outputs[0];
+    outputs.resize(n, first);
+    // branches do not share a context with later requests
+    reset();
+    return outputs;
 }
 
 std::vector<float> Llm::softmax(const std::vector<float>& logits) {
@@ -264,13 +1212,12 @@ std::vector<float> Llm::softmax(const std::vector<float>& logits) {
 float Llm::generate(const std::vector<int>& input_ids, const std::vector<int>& target_ids) {
     prompt_len_ = static_cast<int>(input_ids.size());
     history_ids_.insert(history_ids_.end(), input_ids.begin(), input_ids.end()); // push to history_ids_
-    auto st = std::chrono::system_clock::now();
-    auto logits = forward(input_ids);
-    auto logits_buffer = logits->buffer().as_host().unwrap_or_throw();
-    auto logits_mapped = logits_buffer.map(nncase::runtime::map_read).unwrap_or_throw();
-    auto scores = logits_mapped.buffer().as_span<float>();
-    auto shape = logits->shape();
-    auto size = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int64_t>());
+    auto st = std::chrono::steady_clock::now();
+    auto logits = prefill(input_ids);
+    prefill_us_ = elapsed_us(st);
+    // a full-prompt prefill returns one row per position, the next token is scored by the last
+    int vocab = logits->shape().back();
+    auto scores = logits->map<float>(MAP_READ) + logits->elements() - vocab;
 
     // dump to bin
     // char file_name[64] = "\0";
@@ -283,9 +1230,14 @@ float Llm::generate(const std::vector<int>& input_ids, const std::vector<int>& t
 
     // 4.2 计算 softmax 概率分布
     const float *p_scores = reinterpret_cast<const float *>(&scores[0]);
-    std::vector<float> v_logits(p_scores, p_scores + 151936);
+    std::vector<float> v_logits(p_scores, p_scores + vocab);
+    logits->unmap();
     std::vector<float> probabilities = softmax(v_logits);
 
+    if (target_ids.empty() || target_ids[0] < 0 || target_ids[0] >= vocab) {
+        printf("Failed: target id outside the vocab of %d.\n", vocab);
+        return std::numeric_limits<float>::quiet_NaN();
+    }
     // 获取真实类别的概率
     float true_class_prob = probabilities[target_ids[0]];
     // std::cout << "true_class_prob = " << true_class_prob << std::endl;
@@ -306,21 +1258,25 @@ float Llm::generate(const std::vector<int>& input_ids, const std::vector<int>& t
 }
 
 std::vector<int> Llm::tokenizer(const std::string& query) {
-    auto prompt = apply_prompt_template(query);
-    auto input_ids = tokenizer_->encode(prompt);
-    return input_ids;
+    // through encode, a subclass may expand parts of the prompt
+    return encode(apply_prompt_template(query));
+}
+
+std::vector<int> Llm::encode(const std::string& text, bool with_prefix) {
+    if (tokenizer_ready_.valid()) {
+        tokenizer_ready_.wait();
+    }
+    TraceScope scope(tracer_, TraceStage::Tokenize);
+    return tokenizer_->encode(text, with_prefix);
 }
 
 std::string Llm::response(const std::string& user_content, std::ostream* os, const char* end_with) {
     generate_init();
     if (!end_with) { end_with = "\n"; }
     std::vector<int> input_ids;
-    if (config_->reuse_kv()) {
-        auto prompt = apply_prompt_template(user_content);
-        if (all_seq_len_ > 0) {
-            prompt = "<|im_end|>\n" + prompt;
-        }
-        input_ids = tokenizer_->encode(prompt);
+    if (config_->reuse_kv() && all_seq_len_ > 0) {
+        auto prompt = turn_end() + apply_prompt_template(user_content);
+        input_ids = encode(prompt, false);
     } else {
         input_ids = tokenizer(user_content);
     }
@@ -332,11 +1288,12 @@ std::string Llm::response(const std::vector<PromptItem>& chat_prompts, std::ostr
     generate_init();
     if (!end_with) { end_with = "\n"; }
     auto prompt = apply_chat_template(chat_prompts);
-    if (config_->reuse_kv() && all_seq_len_ > 0) {
-        prompt = "<|im_end|>\n" + prompt;
+    bool continued = config_->reuse_kv() && all_seq_len_ > 0;
+    if (continued) {
+        prompt = turn_end() + prompt;
     }
     // std::cout << "# prompt : " << prompt << std::endl;
-    auto input_ids = tokenizer_->encode(prompt);
+    auto input_ids = encode(prompt, !continued);
     // printf("input_ids (%lu): ", input_ids.size()); for (auto id : input_ids) printf("%d, ", id); printf("\n");
     return generate(input_ids, os, end_with);
 }
@@ -362,6 +1319,30 @@ float Llm::response(const std::string& input_id_file, const std::string& target_
     return generate(input_ids, target_ids);
 }
 
+void Llm::print_profile() {
+    if (!module_) {
+        return;
+    }
+    auto ops = module_->profile();
+    if (ops.empty()) {
+        return;
+    }
+    std::sort(ops.begin(), ops.end(), [](const OpProfile& a, const OpProfile& b) { return a.us > b.us; });
+    int64_t total_us = 0;
+    for (auto& op : ops) {
+        total_us += op.us;
+    }
+    printf("\n#################################\n");
+    printf("  time(ms) |      %% |   count |  avg(us) | type             | name\n");
+    for (auto& op : ops) {
+        printf("%10.2f | %6.2f | %7ld | %8.1f | %-16s | %s\n", op.us / 1e3, op.us * 100.0 / std::max<int64_t>(total_us, 1),
+               static_cast<long>(op.count), static_cast<double>(op.us) / std::max<int64_t>(op.count, 1),
+               op.type.c_str(), op.name.c_str());
+    }
+    printf("total = %.2f ms\n", total_us / 1e3);
+    printf("##################################\n");
+}
+
 void Llm::print_speed() {
     auto prefill_s = prefill_us_ * 1e-6;
     auto decode_s = decode_us_ * 1e-6;
@@ -377,45 +1358,81 @@ void Llm::print_speed() {
     printf("prefill speed = %.2f tok/s\n", prompt_len_ / prefill_s);
     printf(" decode speed = %.2f tok/s\n", gen_seq_len_ / decode_s);
     printf("   chat speed = %.2f tok/s\n", gen_seq_len_ / total_s);
+    if (spec_stats_.rounds > 0) {
+        // a k+1 token verify costs about one decode step on memory bound hardware
+        double step_us = static_cast<double>(spec_stats_.verify_us) / spec_stats_.rounds;
+        printf("  draft tokens = %ld, accepted = %ld\n", static_cast<long>(spec_stats_.proposed),
+               static_cast<long>(spec_stats_.accepted));
+        printf("acceptance rate = %.2f %%\n", spec_stats_.acceptance_rate() * 100);
+        printf(" tokens/verify = %.2f\n", static_cast<double>(spec_stats_.tokens) / spec_stats_.rounds);
+        printf(" spec speedup  = %.2fx\n", spec_stats_.tokens * step_us / spec_stats_.us);
+    }
+    if (tracer_.enabled()) {
+        // where the time of this request goes, prefill and decode include the stages below them
+        auto stage_us = tracer_.stage_us(tracer_.request());
+        for (int i = 0; i < static_cast<int>(TraceStage::Count); i++) {
+            printf("%12s = %.2f ms\n", trace_stage_name(static_cast<TraceStage>(i)), stage_us[i] / 1e3);
+        }
+    }
     printf("##################################\n");
-    nncase::runtime::shrink_memory_pool();
+    backend_->shrink_memory();
 }
 
 
 Llm::~Llm() {
     module_.reset();
-    runtime_manager_.reset();
+    past_key_values_.reset();
+    backend_.reset();
 }
 
-nncase::value_t Llm::embedding(const std::vector<int>& input_ids) {
+TensorPtr Llm::embedding(const std::vector<int>& input_ids) {
     // disk embedding to save memory
     int hidden_size = config_->hidden_size();
     int seq_len = static_cast<int>(input_ids.size());
-    auto inputs_embeds = _Input<float>({seq_len, 1, hidden_size}, runtime_manager_);
-    auto inputs_embeds_buffer = inputs_embeds->buffer().as_host().unwrap_or_throw();
+    // ids index the table directly
+    for (int id : input_ids) {
+        if (id < 0 || id >= embedding_rows_) {
+            throw std::out_of_range("token id " + std::to_string(id) + " is outside the embedding table of " +
+                                    std::to_string(embedding_rows_) + " rows");
+        }
+    }
+    auto inputs_embeds = _Input<float>({seq_len, 1, hidden_size}, backend_);
     {
-        auto inputs_embeds_mapped = inputs_embeds_buffer.map(nncase::runtime::map_write).unwrap_or_throw();
-        auto inputs_embeds_ptr = inputs_embeds_mapped.buffer().as_span<int16_t>().data();
+        auto inputs_embeds_ptr = inputs_embeds->map<int16_t>(MAP_WRITE);
         size_t size = hidden_size * sizeof(int16_t);
-        FILE* file = fopen(config_->embedding_file().c_str(), "rb");
-        std::unique_ptr<int16_t[]> buffer(new int16_t[hidden_size]);
-        for (size_t i = 0; i < seq_len; i++) {
-            fseek(file, input_ids[i] * size, SEEK_SET);
-            size_t bytes_read = fread(buffer.get(), 1, size, file);
-            (void)bytes_read;
-            auto ptr = inputs_embeds_ptr + i * hidden_size * 2;
-            for (int j = 0; j < hidden_size; j++) {
-                ptr[j * 2] = 0;
-                ptr[j * 2 + 1] = buffer[j];
+        if (embedding_table_) {
+            // bf16 -> fp32 from the mapped table
+            auto table = reinterpret_cast<const int16_t*>(embedding_table_->data());
+            for (size_t i = 0; i < seq_len; i++) {
+                auto row = table + static_cast<size_t>(input_ids[i]) * hidden_size;
+                auto ptr = inputs_embeds_ptr + i * hidden_size * 2;
+                for (int j = 0; j < hidden_size; j++) {
+                    ptr[j * 2] = 0;
+                    ptr[j * 2 + 1] = row[j];
+                }
+            }
+        } else {
+            FILE* file = fopen(config_->embedding_file().c_str(), "rb");
+            std::unique_ptr<int16_t[]> buffer(new int16_t[hidden_size]);
+            for (size_t i = 0; i < seq_len; i++) {
+                fseek(file, input_ids[i] * size, SEEK_SET);
+                size_t bytes_read = fread(buffer.get(), 1, size, file);
+                (void)bytes_read;
+                auto ptr = inputs_embeds_ptr + i * hidden_size * 2;
+                for (int j = 0; j < hidden_size; j++) {
+                    ptr[j * 2] = 0;
+                    ptr[j * 2 + 1] = buffer[j];
+                }
             }
+            fclose(file);
         }
-        fclose(file);
     }
-    inputs_embeds_buffer.sync(nncase::runtime::sync_write_back, true).unwrap_or_throw();
-    return std::move(inputs_embeds);
+    inputs_embeds->unmap();
+    return inputs_embeds;
 }
 
 std::string Llm::decode(int id) {
+    TraceScope scope(tracer_, TraceStage::Detokenize);
     std::string word = tokenizer_->decode(id);
     // Fix utf-8 garbled characters
     if (word.length() == 6 && word[0] == '<' && word[word.length()-1] == '>' && word[1] == '0' && word[2] == 'x') {
@@ -425,17 +1442,30 @@ std::string Llm::decode(int id) {
     return word;
 }
 
-nncase::value_t Llm::gen_attention_mask(int seq_len) {
+void Llm::decode(int id, std::string& out) {
+    TraceScope scope(tracer_, TraceStage::Detokenize);
+    size_t start = out.size();
+    tokenizer_->decode_append(id, out);
+    // Fix utf-8 garbled characters
+    if (out.size() - start == 6 && out[start] == '<' && out[start + 5] == '>' && out[start + 1] == '0' && out[start + 2] == 'x') {
+        int num = std::stoi(out.substr(start + 3, 2), nullptr, 16);
+        out.resize(start);
+        out.push_back(static_cast<char>(num));
+    }
+}
+
+TensorPtr Llm::gen_attention_mask(int seq_len, bool decode) {
     int kv_seq_len = all_seq_len_ + seq_len;
-    if (seq_len == 1) {
+    if (decode) {
         kv_seq_len = seq_len;
+    } else if (function_.compare(0, 8, "prefill_") == 0) {
+        // static prefill attends over the whole kv cache, unused slots are masked as future
+        kv_seq_len = kv_capacity_;
     }
     if (config_->attention_mask() == "float") {
-        auto attention_mask = _Input<float>({1, 1, seq_len, kv_seq_len}, runtime_manager_);
-        auto attention_mask_buffer = attention_mask->buffer().as_host().unwrap_or_throw();
+        auto attention_mask = _Input<float>({1, 1, seq_len, kv_seq_len}, backend_);
         {
-            auto attention_mask_mapped = attention_mask_buffer.map(nncase::runtime::map_write).unwrap_or_throw();
-            auto ptr = attention_mask_mapped.buffer().as_span<float>().data();
+            auto ptr = attention_mask->map<float>(MAP_WRITE);
             for (int i = 0; i < seq_len; i++) {
                 for (int j = 0; j < kv_seq_len; j++) {
                     int row = i + all_seq_len_;
@@ -443,14 +1473,12 @@ nncase::value_t Llm::gen_attention_mask(int seq_len) {
                 }
             }
         }
-        attention_mask_buffer.sync(nncase::runtime::sync_write_back, true).unwrap_or_throw();
+        attention_mask->unmap();
         return attention_mask;
     } else {
-        auto attention_mask = _Input<int>({1, 1, seq_len, kv_seq_len}, runtime_manager_);
-        auto attention_mask_buffer = attention_mask->buffer().as_host().unwrap_or_throw();
+        auto attention_mask = _Input<int>({1, 1, seq_len, kv_seq_len}, backend_);
         {
-            auto attention_mask_mapped = attention_mask_buffer.map(nncase::runtime::map_write).unwrap_or_throw();
-            auto ptr = attention_mask_mapped.buffer().as_span<int>().data();
+            auto ptr = attention_mask->map<int>(MAP_WRITE);
             if (config_->attention_mask() == "glm") {
                 // chatglm
                 for (int i = 0; i < seq_len * kv_seq_len; i++) {
@@ -466,25 +1494,23 @@ nncase::value_t Llm::gen_attention_mask(int seq_len) {
                 for (int i = 0; i < seq_len; i++) {
                     for (int j = 0; j < kv_seq_len; j++) {
                         int row = i + all_seq_len_;
-                        ptr[seq_len * i + j] = is_glm2 ? j > row : j <= row;
+                        ptr[kv_seq_len * i + j] = is_glm2 ? j > row : j <= row;
                     }
                 }
             }
         }
-        attention_mask_buffer.sync(nncase::runtime::sync_write_back, true).unwrap_or_throw();
+        attention_mask->unmap();
         return attention_mask;
     }
 }
 
-nncase::value_t Llm::gen_position_ids(int seq_len) {
+TensorPtr Llm::gen_position_ids(int seq_len, bool decode) {
     if (config_->attention_mask() == "glm") {
         // chatglm
-        auto position_ids = _Input<int>({1, 2, seq_len}, runtime_manager_);
-        auto position_ids_buffer = position_ids->buffer().as_host().unwrap_or_throw();
+        auto position_ids = _Input<int>({1, 2, seq_len}, backend_);
         {
-            auto position_ids_mapped = position_ids_buffer.map(nncase::runtime::map_write).unwrap_or_throw();
-            auto ptr = position_ids_mapped.buffer().as_span<int>().data();
-            if (seq_len == 1) {
+            auto ptr = position_ids->map<int>(MAP_WRITE);
+            if (decode) {
                 ptr[0] = all_seq_len_ - gen_seq_len_ - 2;
                 ptr[1] = gen_seq_len_ + 1;
             } else {
@@ -496,24 +1522,25 @@ nncase::value_t Llm::gen_position_ids(int seq_len) {
                 ptr[2 * seq_len - 1] = 1;
             }
         }
-        position_ids_buffer.sync(nncase::runtime::sync_write_back, true).unwrap_or_throw();
+        position_ids->unmap();
         return position_ids;
     } else {
         bool is_glm2 = config_->attention_mask() == "glm2";
-        auto position_ids = _Input<int>({1, seq_len}, runtime_manager_);
-        auto position_ids_buffer = position_ids->buffer().as_host().unwrap_or_throw();
+        // positions follow the kv slot like StreamingLLM, so they stay in the trained range however long
+        // the stream runs; `absolute` counts evicted tokens too, only for an export that supports such positions
+        int offset = all_seq_len_ + (config_->streaming_position() == "absolute" ? evicted_len_ : 0);
+        auto position_ids = _Input<int>({1, seq_len}, backend_);
         {
-            auto position_ids_mapped = position_ids_buffer.map(nncase::runtime::map_write).unwrap_or_throw();
-            auto ptr = position_ids_mapped.buffer().as_span<int>().data();
-            if (seq_len == 1) {
-                ptr[0] = is_glm2 ? gen_seq_len_ : all_seq_len_;
+            auto ptr = position_ids->map<int>(MAP_WRITE);
+            if (decode) {
+                ptr[0] = is_glm2 ? gen_seq_len_ : offset;
             } else {
                 for (int i = 0; i < seq_len; i++) {
-                    ptr[i] = i + all_seq_len_;
+                    ptr[i] = i + offset;
                 }
             }
         }
-        position_ids_buffer.sync(nncase::runtime::sync_write_back, true).unwrap_or_throw();
+        position_ids->unmap();
         return position_ids;
     }
 }
@@ -526,9 +1553,425 @@ Llm* Llm::createLLM(const std::string& config_path) {
     std::shared_ptr<LlmConfig> config(new LlmConfig(config_path));
     Llm* llm = nullptr;
     if (config->is_visual()) {
-        // llm = new Lvlm(config);
+        llm = new Lvlm(config);
     } else {
         llm = new Llm(config);
     }
     return llm;
-}
\ No newline at end of file
+}
+// Llm end
+
+// Lvlm start
+Lvlm::Lvlm(std::shared_ptr<LlmConfig> config) : Llm(config) {
+    image_size_ = config->image_size();
+    image_tokens_ = config->image_tokens();
+    vision_start_ = config->vision_start();
+    vision_end_ = config->vision_end();
+    image_pad_ = config->image_pad();
+    image_mean_ = config->image_mean();
+    image_norm_ = config->image_norm();
+}
+
+Lvlm::~Lvlm() {
+    // decode workers use the feature cache, which is destroyed before images_
+    for (auto& image : images_) {
+        if (image.second.valid()) {
+            image.second.wait();
+        }
+    }
+}
+
+void Lvlm::load() {
+    Llm::load();
+    // the pad id of an export may be a special token past the embedding table, its rows are
+    // overwritten by image features anyway
+    pad_row_ = image_pad_ >= 0 && image_pad_ < embedding_rows_ ? image_pad_ : 0;
+    if (pad_row_ != image_pad_) {
+        printf("image_pad %d is outside the embedding table of %d rows, row 0 stands in for it\n", image_pad_, embedding_rows_);
+    }
+    for (int id : {vision_start_, vision_end_}) {
+        if (id < 0 || id >= embedding_rows_) {
+            printf("Failed: vision token %d is outside the embedding table of %d rows\n", id, embedding_rows_);
+        }
+    }
+    auto st = std::chrono::steady_clock::now();
+    visual_module_ = backend_->load(config_->visual_model());
+    if (!visual_module_) {
+        printf("Failed: can't load visual model %s\n", config_->visual_model().c_str());
+        return;
+    }
+    printf("load visual model: %.2f ms\n", elapsed_us(st) / 1e3);
+}
+
+std::vector<int> Lvlm::encode(const std::string& text, bool with_prefix) {
+    if (tokenizer_ready_.valid()) {
+        tokenizer_ready_.wait();
+    }
+    TraceScope scope(tracer_, TraceStage::Tokenize);
+    // an image already decoding for the previous prompt is not started again
+    auto previous = std::move(images_);
+    images_.clear();
+    image_index_ = 0;
+    image_row_ = 0;
+    current_features_.reset();
+    std::vector<int> ids;
+    static const std::regex img_regex("<img>(.*?)</img>");
+    auto append_text = [&](const std::string& segment, bool first) {
+        // the first segment carries the prefix tokens even when it is empty
+        if (segment.empty() && !(first && with_prefix)) {
+            return;
+        }
+        auto segment_ids = tokenizer_->encode(segment, with_prefix && first);
+        ids.insert(ids.end(), segment_ids.begin(), segment_ids.end());
+    };
+    size_t last = 0;
+    for (std::sregex_iterator iter(text.begin(), text.end(), img_regex), end; iter != end; ++iter) {
+        append_text(text.substr(last, iter->position() - last), last == 0 && ids.empty());
+        last = iter->position() + iter->length();
+        std::string source = (*iter)[1].str();
+        std::shared_future<Image> image;
+        for (auto& item : previous) {
+            if (item.first == source) {
+                image = item.second;
+                break;
+            }
+        }
+        if (!image.valid()) {
+            // decoded while the text before the image prefills
+            image = std::async(std::launch::async, [this, source]() { return load_image(source); }).share();
+        }
+        images_.emplace_back(source, image);
+        ids.push_back(vision_start_);
+        ids.insert(ids.end(), image_tokens_, image_pad_);
+        ids.push_back(vision_end_);
+    }
+    append_text(text.substr(last), last == 0);
+    return ids;
+}
+
+static uint64_t fnv1a(const std::string& bytes) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : bytes) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// images come from prompts and urls, a larger side is refused before any size is computed
+static const int64_t max_image_side = 16384;
+
+// binary ppm (P6, maxval 255), rgb
+static bool decode_ppm(const std::string& bytes, int& width, int& height, std::vector<uint8_t>& rgb) {
+    size_t pos = 2;
+    int64_t header[3];
+    for (int i = 0; i < 3; i++) {
+        // whitespace and # comments between the header fields
+        while (pos < bytes.size() && (isspace(static_cast<unsigned char>(bytes[pos])) || bytes[pos] == '#')) {
+            if (bytes[pos] == '#') {
+                pos = bytes.find('\n', pos);
+                if (pos == std::string::npos) {
+                    return false;
+                }
+            }
+            pos++;
+        }
+        size_t len = 0;
+        header[i] = 0;
+        while (pos < bytes.size() && isdigit(static_cast<unsigned char>(bytes[pos]))) {
+            header[i] = header[i] * 10 + (bytes[pos++] - '0');
+            if (header[i] > max_image_side) {
+                return false;
+            }
+            len++;
+        }
+        if (len == 0) {
+            return false;
+        }
+    }
+    // one whitespace after maxval
+    pos++;
+    uint64_t size = static_cast<uint64_t>(header[0]) * header[1] * 3;
+    if (header[2] != 255 || header[0] <= 0 || header[1] <= 0 || pos > bytes.size() || size > bytes.size() - pos) {
+        return false;
+    }
+    width = static_cast<int>(header[0]);
+    height = static_cast<int>(header[1]);
+    rgb.assign(bytes.begin() + pos, bytes.begin() + pos + size);
+    return true;
+}
+
+// uncompressed 24 or 32 bit bmp, bottom-up or top-down, bgr(a) -> rgb
+static bool decode_bmp(const std::string& bytes, int& width, int& height, std::vector<uint8_t>& rgb) {
+    if (bytes.size() < 54) {
+        return false;
+    }
+    auto read = [&bytes](size_t offset, int size) {
+        uint32_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= static_cast<uint32_t>(static_cast<uint8_t>(bytes[offset + i])) << (i * 8);
+        }
+        return value;
+    };
+    uint64_t offset = read(10, 4);
+    int64_t signed_width = static_cast<int32_t>(read(18, 4));
+    int64_t signed_height = static_cast<int32_t>(read(22, 4));
+    int bpp = read(28, 2);
+    uint32_t compression = read(30, 4);
+    // BI_RGB, or BI_BITFIELDS with the usual bgra masks of 32 bit
+    if ((bpp != 24 && bpp != 32) || (compression != 0 && !(compression == 3 && bpp == 32))) {
+        return false;
+    }
+    // 64 bit before negating, INT32_MIN has no positive int32
+    bool top_down = signed_height < 0;
+    int64_t abs_height = top_down ? -signed_height : signed_height;
+    if (signed_width <= 0 || signed_width > max_image_side || abs_height <= 0 || abs_height > max_image_side) {
+        return false;
+    }
+    uint64_t stride = (static_cast<uint64_t>(signed_width) * bpp / 8 + 3) & ~static_cast<uint64_t>(3);
+    if (offset + stride * abs_height > bytes.size()) {
+        return false;
+    }
+    width = static_cast<int>(signed_width);
+    height = static_cast<int>(abs_height);
+    rgb.resize(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; y++) {
+        auto src = reinterpret_cast<const uint8_t*>(bytes.data()) + offset + stride * (top_down ? y : height - 1 - y);
+        auto dst = rgb.data() + static_cast<size_t>(y) * width * 3;
+        for (int x = 0; x < width; x++) {
+            dst[x * 3] = src[x * bpp / 8 + 2];
+            dst[x * 3 + 1] = src[x * bpp / 8 + 1];
+            dst[x * 3 + 2] = src[x * bpp / 8];
+        }
+    }
+    return true;
+}
+
+Lvlm::Image Lvlm::load_image(const std::string& source, bool force_decode) {
+    Image image;
+    std::string bytes;
+#ifdef LLM_SUPPORT_VISION
+    if (source.rfind("http://", 0) == 0 || source.rfind("https://", 0) == 0) {
+        size_t path_pos = source.find('/', source.find("://") + 3);
+        httplib::Client client(source.substr(0, path_pos));
+        auto res = client.Get(path_pos == std::string::npos ? "/" : source.substr(path_pos));
+        if (!res || res->status != 200) {
+            printf("Failed: can't download image %s\n", source.c_str());
+            return image;
+        }
+        bytes = std::move(res->body);
+    }
+#endif
+    if (bytes.empty()) {
+        std::ifstream ifs(source, std::ios::binary);
+        if (!ifs.is_open()) {
+            printf("Failed: can't open image %s\n", source.c_str());
+            return image;
+        }
+        bytes.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    }
+    image.hash = fnv1a(bytes);
+    if (!force_decode) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (feature_cache_.count(image.hash)) {
+            return image;
+        }
+    }
+    int width = 0, height = 0;
+    std::vector<uint8_t> rgb;
+    bool decoded = false;
+    if (bytes.compare(0, 2, "P6") == 0) {
+        decoded = decode_ppm(bytes, width, height, rgb);
+    } else if (bytes.compare(0, 2, "BM") == 0) {
+        decoded = decode_bmp(bytes, width, height, rgb);
+    }
+    if (!decoded) {
+        printf("Failed: unsupported image %s, only binary ppm and uncompressed bmp are decoded\n", source.c_str());
+        image.hash = 0;
+        return image;
+    }
+    // bilinear resize to image_size x image_size, then normalize into chw
+    int size = image_size_;
+    image.pixels.resize(3 * static_cast<size_t>(size) * size);
+    float scale_x = static_cast<float>(width) / size, scale_y = static_cast<float>(height) / size;
+    for (int y = 0; y < size; y++) {
+        float fy = std::min(std::max((y + 0.5f) * scale_y - 0.5f, 0.f), static_cast<float>(height - 1));
+        int y0 = static_cast<int>(fy), y1 = std::min(y0 + 1, height - 1);
+        float wy = fy - y0;
+        for (int x = 0; x < size; x++) {
+            float fx = std::min(std::max((x + 0.5f) * scale_x - 0.5f, 0.f), static_cast<float>(width - 1));
+            int x0 = static_cast<int>(fx), x1 = std::min(x0 + 1, width - 1);
+            float wx = fx - x0;
+            for (int c = 0; c < 3; c++) {
+                auto at = [&](int py, int px) { return static_cast<float>(rgb[(static_cast<size_t>(py) * width + px) * 3 + c]); };
+                float top = at(y0, x0) * (1 - wx) + at(y0, x1) * wx;
+                float bottom = at(y1, x0) * (1 - wx) + at(y1, x1) * wx;
+                float value = top * (1 - wy) + bottom * wy;
+                image.pixels[(static_cast<size_t>(c) * size + y) * size + x] = (value - image_mean_[c]) * image_norm_[c];
+            }
+        }
+    }
+    return image;
+}
+
+TensorPtr Lvlm::image_features(const std::string& source, const Image& image) {
+    if (image.hash == 0) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto iter = feature_cache_.find(image.hash);
+        if (iter != feature_cache_.end()) {
+            return iter->second;
+        }
+    }
+    if (image.pixels.empty()) {
+        // skipped as cached, but evicted since
+        return image_features(source, load_image(source, true));
+    }
+    if (!visual_module_) {
+        visual_module_ = backend_->load(config_->visual_model());
+        if (!visual_module_) {
+            printf("Failed: can't load visual model %s\n", config_->visual_model().c_str());
+            return nullptr;
+        }
+    }
+    auto pixel_values = _Input<float>({1, 3, image_size_, image_size_}, backend_);
+    ::memcpy(pixel_values->map(MAP_WRITE), image.pixels.data(), image.pixels.size() * sizeof(float));
+    pixel_values->unmap();
+    auto outputs = visual_module_->forward({pixel_values});
+    // [1, image_tokens, hidden], copied out of the module output buffer
+    if (outputs.empty() || outputs[0]->elements() != static_cast<size_t>(image_tokens_) * config_->hidden_size()) {
+        printf("Failed: visual model output doesn't match image_tokens x hidden_size\n");
+        return nullptr;
+    }
+    auto features = backend_->clone(outputs[0]);
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (feature_cache_.emplace(image.hash, features).second) {
+        cache_order_.push_back(image.hash);
+    }
+    while (static_cast<int>(cache_order_.size()) > std::max(config_->image_cache_size(), 1)) {
+        feature_cache_.erase(cache_order_.front());
+        cache_order_.pop_front();
+    }
+    return features;
+}
+
+TensorPtr Lvlm::embedding(const std::vector<int>& input_ids) {
+    if (std::find(input_ids.begin(), input_ids.end(), image_pad_) == input_ids.end()) {
+        return Llm::embedding(input_ids);
+    }
+    auto table_ids = input_ids;
+    std::replace(table_ids.begin(), table_ids.end(), image_pad_, pad_row_);
+    auto inputs_embeds = Llm::embedding(table_ids);
+    int hidden_size = config_->hidden_size();
+    auto embeds_ptr = inputs_embeds->map<float>(MAP_READ_WRITE);
+    const float* features_ptr = nullptr;
+    for (size_t i = 0; i < input_ids.size(); i++) {
+        if (input_ids[i] == vision_start_) {
+            // the cursor moves to the next image, a chunk may end inside its pad rows
+            if (features_ptr) {
+                current_features_->unmap();
+                features_ptr = nullptr;
+            }
+            current_features_.reset();
+            image_row_ = 0;
+            if (image_index_ < images_.size()) {
+                auto& item = images_[image_index_++];
+                current_features_ = image_features(item.first, item.second.get());
+            } else {
+                printf("Failed: more images in the prompt than were encoded\n");
+            }
+        } else if (input_ids[i] == image_pad_ && current_features_ && image_row_ < image_tokens_) {
+            if (!features_ptr) {
+                features_ptr = current_features_->map<float>(MAP_READ);
+            }
+            ::memcpy(embeds_ptr + i * hidden_size, features_ptr + static_cast<size_t>(image_row_) * hidden_size,
+                     hidden_size * sizeof(float));
+            image_row_++;
+        }
+    }
+    if (features_ptr) {
+        current_features_->unmap();
+    }
+    inputs_embeds->unmap();
+    return inputs_embeds;
+}
+
+int Lvlm::ready_len(const std::vector<int>& input_ids, int pos) const {
+    // images before pos are consumed, the next ones follow in prompt order
+    size_t index = image_index_;
+    for (int i = pos; i < static_cast<int>(input_ids.size()); i++) {
+        if (input_ids[i] != vision_start_) {
+            continue;
+        }
+        if (index < images_.size() &&
+            images_[index].second.wait_for(std::chrono::seconds(0)) != std::future_status::ready && i > pos) {
+            return i - pos;
+        }
+        index++;
+    }
+    return static_cast<int>(input_ids.size()) - pos;
+}
+// Lvlm end
+
+// Conversation start
+std::vector<int> Conversation::rebuild(const std::string& user_content) {
+    // drop the oldest turns until the whole history and an answer fit in context
+    int max_context = llm_->max_context();
+    int reserve = std::min(llm_->config_->max_new_tokens(), max_context / 2);
+    size_t first = (!history_.empty() && history_[0].first == "system") ? 1 : 0;
+    while (true) {
+        auto prompts = history_;
+        prompts.emplace_back("user", user_content);
+        auto input_ids = llm_->encode(llm_->apply_chat_template(prompts));
+        if (input_ids.size() + reserve <= max_context || history_.size() <= first) {
+            return input_ids;
+        }
+        // remove one user/assistant pair
+        size_t count = std::min<size_t>(2, history_.size() - first);
+        history_.erase(history_.begin() + first, history_.begin() + first + count);
+    }
+}
+
+std::string Conversation::response(const std::string& user_content, std::ostream* os, const char* end_with) {
+    if (!end_with) { end_with = "\n"; }
+    if (history_.empty() && !system_prompt_.empty()) {
+        history_.emplace_back("system", system_prompt_);
+    }
+    std::vector<int> input_ids;
+    bool continued = llm_->all_seq_len_ > 0;
+    if (continued) {
+        // only the delta of this turn, the kv cache already holds the history
+        auto prompt = llm_->turn_end() + llm_->apply_chat_template({{"user", user_content}});
+        input_ids = llm_->encode(prompt, false);
+    } else {
+        std::vector<PromptItem> prompts = history_;
+        prompts.emplace_back("user", user_content);
+        input_ids = llm_->encode(llm_->apply_chat_template(prompts));
+    }
+    int max_context = llm_->max_context();
+    int reserve = std::min(llm_->config_->max_new_tokens(), max_context / 2);
+    auto history = history_;
+    if (max_context > 0 && llm_->all_seq_len_ + input_ids.size() + reserve > max_context &&
+        !llm_->config_->streaming_kv()) {
+        // context is full, slide the window and prefill the retained turns again
+        input_ids = rebuild(user_content);
+        continued = false;
+    }
+    llm_->generate_init(continued);
+    // a refused prompt is not a turn, an empty answer in history would be prefilled by the next rebuild
+    if (!llm_->fit_context(input_ids)) {
+        history_ = std::move(history);
+        return "";
+    }
+    auto assistant_str = llm_->generate(input_ids, os, end_with);
+    history_.emplace_back("user", user_content);
+    history_.emplace_back("assistant", assistant_str);
+    return assistant_str;
+}
+
+void Conversation::reset() {
+    history_.clear();
+    llm_->reset();
+}
+// Conversation end
\ No newline at end of file
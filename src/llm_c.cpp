@@ -0,0 +1,215 @@
+//
+//  llm_c.cpp
+//
+//  C ABI over Llm, exceptions stop here and become return codes.
+//
+
+#include <cstring>
+#include <algorithm>
+
+#include "llm_c.h"
+#include "llm.hpp"
+
+struct llm_handle {
+    std::unique_ptr<Llm> llm;
+    bool loaded = false;
+    std::string error;
+    std::string text;
+};
+
+template <typename Func>
+static int guard(llm_handle* handle, Func&& func) {
+    if (!handle) {
+        return LLM_ERROR_ARGUMENT;
+    }
+    try {
+        return func();
+    } catch (const std::exception& e) {
+        handle->error = e.what();
+    } catch (...) {
+        handle->error = "unknown error";
+    }
+    return LLM_ERROR_RUNTIME;
+}
+
+static int fail(llm_handle* handle, int code, const char* message) {
+    handle->error = message;
+    return code;
+}
+
+// ids index the embedding table, out of range ids are the caller's error
+static bool valid_ids(llm_handle* handle, const int32_t* ids, int n_ids) {
+    int rows = handle->llm->embedding_rows();
+    return std::all_of(ids, ids + n_ids, [rows](int32_t id) { return id >= 0 && id < rows; });
+}
+
+llm_handle* llm_create(const char* config_path) {
+    if (!config_path) {
+        return nullptr;
+    }
+    try {
+        std::unique_ptr<llm_handle> handle(new llm_handle);
+        handle->llm.reset(Llm::createLLM(config_path));
+        return handle.release();
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void llm_free(llm_handle* llm) {
+    delete llm;
+}
+
+int llm_load(llm_handle* llm) {
+    return guard(llm, [&]() {
+        llm->llm->load();
+        llm->loaded = true;
+        return LLM_OK;
+    });
+}
+
+int llm_set_config(llm_handle* llm, const char* json_patch) {
+    return guard(llm, [&]() {
+        if (!json_patch || !llm->llm->set_config(json_patch)) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "invalid config patch");
+        }
+        return LLM_OK;
+    });
+}
+
+const char* llm_last_error(llm_handle* llm) {
+    return llm ? llm->error.c_str() : "null handle";
+}
+
+int llm_tokenize(llm_handle* llm, const char* text, int apply_template, int32_t* ids, int capacity) {
+    return guard(llm, [&]() {
+        if (!text || (capacity > 0 && !ids)) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "null text or ids");
+        }
+        if (!llm->loaded) {
+            return fail(llm, LLM_ERROR_STATE, "llm is not loaded");
+        }
+        auto input_ids = apply_template ? llm->llm->tokenizer(text) : llm->llm->encode(text);
+        int count = static_cast<int>(input_ids.size());
+        std::copy_n(input_ids.begin(), std::min(count, std::max(capacity, 0)), ids);
+        return count;
+    });
+}
+
+int llm_detokenize(llm_handle* llm, int32_t id, char* text, int capacity) {
+    return guard(llm, [&]() {
+        if (capacity > 0 && !text) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "null text");
+        }
+        if (!llm->loaded) {
+            return fail(llm, LLM_ERROR_STATE, "llm is not loaded");
+        }
+        llm->text.clear();
+        llm->llm->decode(id, llm->text);
+        int len = static_cast<int>(llm->text.size());
+        ::memcpy(text, llm->text.data(), std::min(len, std::max(capacity, 0)));
+        return len;
+    });
+}
+
+int llm_forward(llm_handle* llm, const int32_t* ids, int n_ids, float* logits, int capacity) {
+    return guard(llm, [&]() {
+        if (!ids || n_ids <= 0 || (capacity > 0 && !logits)) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "null ids or logits");
+        }
+        if (!llm->loaded) {
+            return fail(llm, LLM_ERROR_STATE, "llm is not loaded");
+        }
+        if (!valid_ids(llm, ids, n_ids)) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "token id outside the vocab");
+        }
+        auto& model = *llm->llm;
+        if (model.all_seq_len_ == 0) {
+            model.generate_init(false);
+        }
+        if (n_ids > model.context_room()) {
+            return fail(llm, LLM_ERROR_STATE, "context is full");
+        }
+        std::vector<int> input_ids(ids, ids + n_ids);
+        auto output = model.prefill(input_ids);
+        model.history_ids_.insert(model.history_ids_.end(), input_ids.begin(), input_ids.end());
+        int vocab = output->shape().back();
+        auto scores = output->map<float>(MAP_READ) + output->elements() - vocab;
+        ::memcpy(logits, scores, std::min(vocab, std::max(capacity, 0)) * sizeof(float));
+        output->unmap();
+        return vocab;
+    });
+}
+
+int llm_generate(llm_handle* llm, const int32_t* ids, int n_ids, int max_new_tokens,
+                 llm_token_callback callback, void* user_data,
+                 char* text, size_t text_capacity,
+                 int32_t* out_ids, int out_ids_capacity, llm_result* result) {
+    return guard(llm, [&]() {
+        if (!ids || n_ids <= 0 || (text_capacity > 0 && !text) || (out_ids_capacity > 0 && !out_ids)) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "null ids or output buffer");
+        }
+        if (!llm->loaded) {
+            return fail(llm, LLM_ERROR_STATE, "llm is not loaded");
+        }
+        if (!valid_ids(llm, ids, n_ids)) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "token id outside the vocab");
+        }
+        auto& model = *llm->llm;
+        model.generate_init();
+        GenerationControl control;
+        control.max_new_tokens = max_new_tokens;
+        if (callback) {
+            control.on_token = [&](int id, std::string_view piece, const TokenStats&) {
+                if (callback(id, piece.data(), piece.size(), user_data)) {
+                    control.cancel();
+                }
+            };
+        }
+        auto output = model.generate(std::vector<int>(ids, ids + n_ids), control);
+        if (text_capacity > 0) {
+            size_t len = std::min(output.text.size(), text_capacity - 1);
+            ::memcpy(text, output.text.data(), len);
+            text[len] = '\0';
+        }
+        int count = static_cast<int>(output.ids.size());
+        std::copy_n(output.ids.begin(), std::min(count, std::max(out_ids_capacity, 0)), out_ids);
+        if (result) {
+            result->finish_reason = static_cast<int32_t>(output.finish_reason);
+            result->prompt_tokens = output.prompt_tokens;
+            result->completion_tokens = output.completion_tokens;
+            result->ttft_us = output.ttft_us;
+            result->total_us = output.total_us;
+            result->text_len = output.text.size();
+        }
+        return count;
+    });
+}
+
+int llm_reset(llm_handle* llm) {
+    return guard(llm, [&]() {
+        llm->llm->reset();
+        return LLM_OK;
+    });
+}
+
+int llm_session_save(llm_handle* llm, const char* path) {
+    return guard(llm, [&]() {
+        if (!path) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "null path");
+        }
+        return llm->llm->save_session(path) ? LLM_OK : fail(llm, LLM_ERROR_RUNTIME, "session save failed");
+    });
+}
+
+int llm_session_load(llm_handle* llm, const char* path) {
+    return guard(llm, [&]() {
+        if (!path) {
+            return fail(llm, LLM_ERROR_ARGUMENT, "null path");
+        }
+        if (!llm->loaded) {
+            return fail(llm, LLM_ERROR_STATE, "llm is not loaded");
+        }
+        return llm->llm->load_session(path) ? LLM_OK : fail(llm, LLM_ERROR_RUNTIME, "session load failed");
+    });
+}
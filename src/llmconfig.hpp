@@ -80,32 +80,65 @@ public:
 
     // < model file config start
     DEFINE_CONFIG_PATH_ACCESSOR(llm_config, "llm_config.json")
-#if ORT
-    DEFINE_CONFIG_PATH_ACCESSOR(llm_model, "onnx/llm.onnx")
-#else
-    DEFINE_CONFIG_PATH_ACCESSOR(llm_model, "llm.kmodel")
-#endif
+    std::string llm_model() const {
+        bool ort = Backend::resolve(backend_type()) == "ort";
+        return base_dir_ + config_.value("llm_model", ort ? "onnx/llm.onnx" : "llm.kmodel");
+    }
     DEFINE_CONFIG_PATH_ACCESSOR(llm_weight, "onnx/llm.onnx.data")
     DEFINE_CONFIG_PATH_ACCESSOR(lm_model, "lm.mnn")
     DEFINE_CONFIG_PATH_ACCESSOR(embedding_model, "embedding.mnn")
     DEFINE_CONFIG_PATH_ACCESSOR(embedding_file, "embeddings_bf16.bin")
     DEFINE_CONFIG_PATH_ACCESSOR(tokenizer_file, "tokenizer.txt")
-    DEFINE_CONFIG_PATH_ACCESSOR(visual_model, "visual.mnn")
+    std::string visual_model() const {
+        bool ort = Backend::resolve(backend_type()) == "ort";
+        return base_dir_ + config_.value("visual_model", ort ? "onnx/visual.onnx" : "visual.kmodel");
+    }
     // model file config end >
 
     // < generate config start
     DEFINE_CONFIG_ACCESSOR(max_new_tokens, int, 512)
     DEFINE_CONFIG_ACCESSOR(reuse_kv, bool, false)
+    DEFINE_CONFIG_ACCESSOR(temperature, float, 0.f)
+    DEFINE_CONFIG_ACCESSOR(top_k, int, 40)
+    DEFINE_CONFIG_ACCESSOR(top_p, float, 1.f)
+    DEFINE_CONFIG_ACCESSOR(seed, int, -1)
+    DEFINE_CONFIG_ACCESSOR(max_context, int, -1)
+    DEFINE_CONFIG_ACCESSOR(streaming_kv, bool, false)
+    DEFINE_CONFIG_ACCESSOR(attention_sink, int, 4)
+    DEFINE_CONFIG_ACCESSOR(sliding_window, int, -1)
+    DEFINE_CONFIG_ACCESSOR(streaming_position, std::string, "relative")
+    DEFINE_CONFIG_ACCESSOR(prefill_chunk, int, -1)
+    DEFINE_CONFIG_ACCESSOR(max_batch, int, 1)
+    DEFINE_CONFIG_ACCESSOR(draft_config, std::string, "")
+    DEFINE_CONFIG_ACCESSOR(draft_tokens, int, 4)
+    DEFINE_CONFIG_ACCESSOR(lookup_ngram, int, 0)
     DEFINE_CONFIG_ACCESSOR(backend_type, std::string, "cpu")
     DEFINE_CONFIG_ACCESSOR(thread_num, int, 4)
+    DEFINE_CONFIG_ACCESSOR(inter_thread_num, int, 1)
+    DEFINE_CONFIG_ACCESSOR(thread_affinity, std::string, "")
     DEFINE_CONFIG_ACCESSOR(precision, std::string, "low")
     DEFINE_CONFIG_ACCESSOR(power, std::string, "normal")
     DEFINE_CONFIG_ACCESSOR(memory, std::string, "low")
+    // ort graph optimization level, 0: disable, 1: basic, 2: extended, 3: all
+    DEFINE_CONFIG_ACCESSOR(graph_optimization, int, 2)
     DEFINE_CONFIG_ACCESSOR(quant_qkv, int, 0)
     DEFINE_CONFIG_ACCESSOR(kvcache_limit, int, -1)
+    DEFINE_CONFIG_ACCESSOR(kvcache_overflow, std::string, "truncate")
     DEFINE_CONFIG_ACCESSOR(use_mmap, bool, false)
+    DEFINE_CONFIG_ACCESSOR(mmap_prefetch, bool, false)
+    // drop model files from page cache before loading, times a cold load
+    DEFINE_CONFIG_ACCESSOR(load_cold, bool, false)
     DEFINE_CONFIG_ACCESSOR(kvcache_mmap, bool, false)
+    DEFINE_CONFIG_ACCESSOR(mmz_alloc, bool, false)
     DEFINE_CONFIG_ACCESSOR(tmp_path, std::string, "")
+    DEFINE_CONFIG_ACCESSOR(io_binding, bool, false)
+    DEFINE_CONFIG_ACCESSOR(trace, bool, false)
+    DEFINE_CONFIG_ACCESSOR(trace_capacity, int, 65536)
+    DEFINE_CONFIG_ACCESSOR(profile, bool, false)
+    DEFINE_CONFIG_ACCESSOR(profile_prefix, std::string, "llm_profile")
+    DEFINE_CONFIG_ACCESSOR(mock_vocab_size, int, 32000)
+    DEFINE_CONFIG_ACCESSOR(mock_delay_us, int, 0)
+    DEFINE_CONFIG_ACCESSOR(image_cache_size, int, 8)
     // generate config end >
 
     // < llm model config start
@@ -114,9 +147,20 @@ public:
     DEFINE_LLM_CONFIG_ACCESSOR(hidden_size, int, 4096)
     DEFINE_LLM_CONFIG_ACCESSOR(layer_nums, int, 32)
     DEFINE_LLM_CONFIG_ACCESSOR(key_value_shape, std::vector<int>, std::vector<int>{})
+    DEFINE_LLM_CONFIG_ACCESSOR(kv_seq_axis, int, 2)
+    DEFINE_LLM_CONFIG_ACCESSOR(kv_batch_axis, int, -1)
+    DEFINE_LLM_CONFIG_ACCESSOR(prefill_lens, std::vector<int>, std::vector<int>({64, 256, 1024}))
     DEFINE_LLM_CONFIG_ACCESSOR(attention_mask, std::string, "int")
     DEFINE_LLM_CONFIG_ACCESSOR(attention_fused, bool, true)
     DEFINE_LLM_CONFIG_ACCESSOR(chat_template, std::string, "")
     DEFINE_LLM_CONFIG_ACCESSOR(prompt_template, std::string, "")
+    // qwen-vl defaults
+    DEFINE_LLM_CONFIG_ACCESSOR(image_size, int, 448)
+    DEFINE_LLM_CONFIG_ACCESSOR(image_tokens, int, 256)
+    DEFINE_LLM_CONFIG_ACCESSOR(vision_start, int, 151857)
+    DEFINE_LLM_CONFIG_ACCESSOR(vision_end, int, 151858)
+    DEFINE_LLM_CONFIG_ACCESSOR(image_pad, int, 151859)
+    DEFINE_LLM_CONFIG_ACCESSOR(image_mean, std::vector<float>, std::vector<float>({122.7709383f, 116.7460125f, 104.09373615f}))
+    DEFINE_LLM_CONFIG_ACCESSOR(image_norm, std::vector<float>, std::vector<float>({0.01459843f, 0.01500777f, 0.01422007f}))
     // llm model config end >
 };
\ No newline at end of file
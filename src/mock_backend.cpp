@@ -0,0 +1,134 @@
+//
+//  mock_backend.cpp
+//
+//  Host only backend with a fake model, runs Llm without model files.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "backend.hpp"
+
+class MockTensor : public Tensor {
+public:
+    MockTensor(DataType dtype, const std::vector<int>& shape) {
+        dtype_ = dtype;
+        shape_ = shape;
+        data_.resize(bytes());
+    }
+    virtual void* map(MapAccess /* access */) override { return data_.data(); }
+    virtual void unmap() override {}
+private:
+    std::vector<uint8_t> data_;
+};
+
+// logits peak at one token chosen by the input, its position and the kv rows before it, the same inputs
+// always give the same token; every forward writes a key of each input at the rows of `set_kv_rows` and
+// passes the kv cache through as present, so a wrong kv length, eviction or rollback changes the output
+class MockModule : public Module {
+public:
+    MockModule(const BackendOptions& options) : vocab_size_(options.mock_vocab_size), delay_us_(options.mock_delay_us) {}
+    virtual void set_kv_rows(int axis, int start, int /* count */) override {
+        kv_axis_ = axis;
+        kv_start_ = start;
+    }
+    virtual std::vector<TensorPtr> forward(const std::vector<TensorPtr>& inputs) override {
+        auto st = std::chrono::steady_clock::now();
+        auto& embeds = inputs[0];
+        auto& position_ids = inputs[2];
+        // [seq, 1, hidden], or [1, batch, hidden] of a batch forward
+        int hidden_size = embeds->shape().back();
+        int seq_len = static_cast<int>(embeds->elements()) / std::max(hidden_size, 1);
+        // logits of every position, like a model exported for speculative verify
+        TensorPtr logits(new MockTensor(DataType::Float32, {1, seq_len, vocab_size_}));
+        auto embeds_ptr = embeds->map<uint32_t>(MAP_READ);
+        auto position_ptr = position_ids->map<int>(MAP_READ);
+        auto logits_ptr = logits->map<float>(MAP_WRITE);
+        // fnv-1a
+        auto mix = [](uint64_t hash, uint32_t value) {
+            for (int b = 0; b < 4; b++) {
+                hash = (hash ^ ((value >> (b * 8)) & 0xff)) * 1099511628211ull;
+            }
+            return hash;
+        };
+        // the key of a token is the first value of its row in the first outer slice of the kv cache;
+        // a batch forward doesn't set kv rows, its tokens only depend on input and position
+        auto& kv = inputs[3];
+        bool with_kv = kv_axis_ > 0 && kv && kv_axis_ < static_cast<int>(kv->shape().size());
+        uint32_t* kv_ptr = nullptr;
+        int capacity = 0;
+        size_t row_stride = 0;
+        uint64_t context = 14695981039346656037ull;
+        if (with_kv) {
+            size_t outer = 1;
+            for (int i = 0; i < kv_axis_; i++) {
+                outer *= kv->shape()[i];
+            }
+            capacity = kv->shape()[kv_axis_];
+            row_stride = kv->bytes() / sizeof(uint32_t) / (outer * capacity);
+            kv_ptr = kv->map<uint32_t>(MAP_READ_WRITE);
+            for (int r = 0; r < std::min(kv_start_, capacity); r++) {
+                context = mix(context, kv_ptr[r * row_stride]);
+            }
+        }
+        for (int i = 0; i < seq_len; i++) {
+            uint64_t key = 14695981039346656037ull;
+            for (int j = 0; j < std::min(hidden_size, 8); j++) {
+                key = mix(key, embeds_ptr[i * hidden_size + j]);
+            }
+            // position ids are [1, seq], [batch, 1] or [1, 2, seq] for glm, the first row is the position
+            key = mix(key, static_cast<uint32_t>(position_ptr[i]));
+            uint64_t hash = key;
+            if (with_kv) {
+                hash = mix(context, static_cast<uint32_t>(key));
+                if (kv_start_ + i < capacity) {
+                    kv_ptr[(kv_start_ + i) * row_stride] = static_cast<uint32_t>(key);
+                }
+                context = mix(context, static_cast<uint32_t>(key));
+            }
+            auto row = logits_ptr + static_cast<size_t>(i) * vocab_size_;
+            for (int v = 0; v < vocab_size_; v++) {
+                row[v] = -static_cast<float>(v % 97) / 97.f;
+            }
+            row[hash % vocab_size_] = 10.f;
+        }
+        if (with_kv) {
+            kv->unmap();
+        }
+        // rows are set for one forward
+        kv_axis_ = -1;
+        embeds->unmap();
+        position_ids->unmap();
+        logits->unmap();
+        if (delay_us_ > 0) {
+            // synthetic compute, the host work above counts toward it
+            std::this_thread::sleep_until(st + std::chrono::microseconds(delay_us_));
+        }
+        return {logits, inputs[3]};
+    }
+    virtual size_t weight_size() const override { return 0; }
+private:
+    int vocab_size_;
+    int delay_us_;
+    int kv_axis_ = -1;
+    int kv_start_ = 0;
+};
+
+class MockBackend : public Backend {
+public:
+    MockBackend(const BackendOptions& options) : options_(options) {}
+    virtual std::string name() const override { return "mock"; }
+    virtual TensorPtr create_tensor(DataType dtype, const std::vector<int>& shape) override {
+        return std::make_shared<MockTensor>(dtype, shape);
+    }
+    // no file is read, path is ignored
+    virtual std::shared_ptr<Module> load(const std::string& /* path */) override {
+        return std::make_shared<MockModule>(options_);
+    }
+private:
+    BackendOptions options_;
+};
+
+Backend* createMockBackend(const BackendOptions& options) {
+    return new MockBackend(options);
+}
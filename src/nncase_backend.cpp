@@ -0,0 +1,195 @@
+//
+//  nncase_backend.cpp
+//
+//  Backend on nncase runtime, K230 and x86_64 simulator.
+//
+
+#ifdef LLM_BACKEND_NNCASE
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include "backend.hpp"
+#include "nncasewrapper.hpp"
+#include "json.hpp"
+#ifdef LLM_NNCASE_OP_PROFILE
+#include <nncase/runtime/stackvm/op_profile.h>
+#endif
+
+using json = nlohmann::json;
+
+static nncase::typecode_t to_typecode(DataType dtype) {
+    switch (dtype) {
+        case DataType::Float32: return nncase::dt_float32;
+        case DataType::Int32: return nncase::dt_int32;
+        case DataType::Int64: return nncase::dt_int64;
+        case DataType::Float16: return nncase::dt_float16;
+        case DataType::BFloat16: return nncase::dt_bfloat16;
+        case DataType::Int16: return nncase::dt_int16;
+        case DataType::Int8: return nncase::dt_int8;
+        default: return nncase::dt_uint8;
+    }
+}
+
+static DataType from_typecode(nncase::typecode_t typecode) {
+    switch (typecode) {
+        case nncase::dt_float32: return DataType::Float32;
+        case nncase::dt_int32: return DataType::Int32;
+        case nncase::dt_int64: return DataType::Int64;
+        case nncase::dt_float16: return DataType::Float16;
+        case nncase::dt_bfloat16: return DataType::BFloat16;
+        case nncase::dt_int16: return DataType::Int16;
+        case nncase::dt_int8: return DataType::Int8;
+        case nncase::dt_uint8: return DataType::UInt8;
+        default: throw std::runtime_error("unsupported nncase datatype");
+    }
+}
+
+class NncaseTensor : public Tensor {
+public:
+    NncaseTensor(nncase::tensor tensor, std::shared_ptr<Nncase::RuntimeManager> runtime)
+        : tensor_(std::move(tensor)), runtime_(std::move(runtime)) {
+        dtype_ = from_typecode(tensor_->dtype()->typecode());
+        shape_.assign(tensor_->shape().begin(), tensor_->shape().end());
+    }
+    virtual void* map(MapAccess access) override {
+        buffer_ = tensor_->buffer().as_host().unwrap_or_throw();
+        access_ = access;
+        mapped_ = buffer_.map(static_cast<nncase::runtime::map_access_t>(access)).unwrap_or_throw();
+        return mapped_.buffer().data();
+    }
+    virtual void unmap() override {
+        mapped_.unmap().unwrap_or_throw();
+        if (access_ & MAP_WRITE) {
+            buffer_.sync(nncase::runtime::sync_write_back, true).unwrap_or_throw();
+            // the device reads mmz blocks through memory, write back once per host write, not per invoke
+            runtime_->flush(tensor_);
+        }
+    }
+    const nncase::tensor& tensor() const { return tensor_; }
+private:
+    nncase::tensor tensor_;
+    std::shared_ptr<Nncase::RuntimeManager> runtime_;
+    nncase::runtime::host_buffer_slice buffer_;
+    nncase::runtime::mapped_buffer mapped_;
+    MapAccess access_ = MAP_READ;
+};
+
+class NncaseModule : public Module {
+public:
+    NncaseModule(std::shared_ptr<Nncase::RuntimeManager> runtime, const std::string& path, const BackendOptions& options)
+        : module_(runtime, path), runtime_(runtime), profile_(options.profile), profile_prefix_(options.profile_prefix) {}
+    virtual std::vector<TensorPtr> forward(const std::vector<TensorPtr>& inputs) override {
+        std::vector<nncase::value_t> values;
+        for (auto& input : inputs) {
+            values.emplace_back(static_cast<NncaseTensor*>(input.get())->tensor());
+        }
+        auto st = std::chrono::steady_clock::now();
+        auto outputs = module_.onForward(values);
+        if (profile_) {
+            auto now = std::chrono::steady_clock::now();
+            invokes_.push_back({function_.empty() ? "entry" : function_,
+                                std::chrono::duration_cast<std::chrono::microseconds>(st.time_since_epoch()).count(),
+                                std::chrono::duration_cast<std::chrono::microseconds>(now - st).count()});
+        }
+        std::vector<TensorPtr> results;
+        for (auto& field : outputs->fields()) {
+            results.emplace_back(new NncaseTensor(field.as<nncase::tensor>().unwrap_or_throw(), runtime_));
+        }
+        return results;
+    }
+    virtual void set_kv_rows(int axis, int start, int count) override { module_.set_kv_rows(axis, start, count); }
+    virtual bool has_function(const std::string& name) override { return module_.has_function(name); }
+    virtual void select_function(const std::string& name) override {
+        module_.select_function(name);
+        function_ = name;
+    }
+    virtual size_t weight_size() const override { return module_.weight_size(); }
+    virtual std::vector<OpProfile> profile() override {
+        // the prebuilt runtime has no op timing, functions (`prefill_{len}`, `decode`) are timed around invoke;
+        // a runtime built with op profiling exposes stackvm op_profile, NNCASE_OP_PROFILE uses it when it links
+        std::map<std::string, OpProfile> ops;
+        json trace_events = json::array();
+        for (auto& invoke : invokes_) {
+            auto& op = ops["function/" + invoke.function];
+            op.name = "function/" + invoke.function;
+            op.type = "invoke";
+            op.count++;
+            op.us += invoke.dur_us;
+            trace_events.push_back({{"name", invoke.function}, {"cat", "invoke"}, {"ph", "X"},
+                                    {"ts", invoke.start_us}, {"dur", invoke.dur_us}, {"pid", 0}, {"tid", 0}});
+        }
+#ifdef LLM_NNCASE_OP_PROFILE
+        for (auto& timing : op_profile::op_timing_) {
+            auto& name = std::get<0>(timing);
+            int64_t start_us = static_cast<int64_t>(std::get<2>(timing) * 1e3);
+            int64_t dur_us = static_cast<int64_t>((std::get<3>(timing) - std::get<2>(timing)) * 1e3);
+            auto& op = ops[name];
+            op.name = name;
+            op.type = "op";
+            op.count++;
+            op.us += dur_us;
+            trace_events.push_back({{"name", name}, {"cat", "op"}, {"ph", "X"},
+                                    {"ts", start_us}, {"dur", dur_us}, {"pid", 0}, {"tid", 1}});
+        }
+        op_profile::op_timing_.clear();
+#endif
+        invokes_.clear();
+        if (ops.empty()) {
+            return {};
+        }
+        auto path = profile_prefix_ + "_nncase.json";
+        std::ofstream ofs(path);
+        ofs << json({{"traceEvents", trace_events}}).dump();
+        printf("nncase profile is saved to %s\n", path.c_str());
+        std::vector<OpProfile> results;
+        for (auto& op : ops) {
+            results.push_back(op.second);
+        }
+        return results;
+    }
+private:
+    struct Invoke {
+        std::string function;
+        int64_t start_us;
+        int64_t dur_us;
+    };
+    Nncase::Module module_;
+    std::shared_ptr<Nncase::RuntimeManager> runtime_;
+    std::string function_;
+    bool profile_ = false;
+    std::string profile_prefix_;
+    std::vector<Invoke> invokes_;
+};
+
+class NncaseBackend : public Backend {
+public:
+    NncaseBackend(const BackendOptions& options) {
+        Nncase::RuntimeOptions runtime_options;
+        runtime_options.mmz_alloc = options.mmz_alloc;
+        runtime_options.use_mmap = options.use_mmap;
+        runtime_options.mmap_prefetch = options.mmap_prefetch;
+        runtime_.reset(new Nncase::RuntimeManager(runtime_options));
+        options_ = options;
+    }
+    virtual std::string name() const override { return "nncase"; }
+    virtual TensorPtr create_tensor(DataType dtype, const std::vector<int>& shape) override {
+        return std::make_shared<NncaseTensor>(Nncase::_Create(to_typecode(dtype), shape, runtime_), runtime_);
+    }
+    virtual std::shared_ptr<Module> load(const std::string& path) override {
+        return std::make_shared<NncaseModule>(runtime_, path, options_);
+    }
+    virtual void shrink_memory() override {
+        nncase::runtime::shrink_memory_pool();
+    }
+private:
+    std::shared_ptr<Nncase::RuntimeManager> runtime_;
+    BackendOptions options_;
+};
+
+Backend* createNncaseBackend(const BackendOptions& options) {
+    return new NncaseBackend(options);
+}
+
+#endif // LLM_BACKEND_NNCASE
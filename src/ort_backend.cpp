@@ -0,0 +1,229 @@
+//
+//  ort_backend.cpp
+//
+//  Backend on onnxruntime.
+//
+
+#ifdef LLM_BACKEND_ORT
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include "backend.hpp"
+#include "ortwrapper.hpp"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// node names differ only by the layer index, eg: `/model/layers.3/mlp/down_proj/MatMul`, sum them as `layers.*`
+static std::string layer_pattern(const std::string& name) {
+    std::string pattern;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (std::isdigit(static_cast<unsigned char>(name[i])) && i > 0 && name[i - 1] == '.') {
+            pattern += '*';
+            while (i + 1 < name.size() && std::isdigit(static_cast<unsigned char>(name[i + 1]))) {
+                i++;
+            }
+        } else {
+            pattern += name[i];
+        }
+    }
+    return pattern;
+}
+
+static ONNXTensorElementDataType to_ort_type(DataType dtype) {
+    switch (dtype) {
+        case DataType::Float32: return ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT;
+        case DataType::Int32: return ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32;
+        case DataType::Int64: return ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64;
+        case DataType::Float16: return ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16;
+        case DataType::BFloat16: return ONNX_TENSOR_ELEMENT_DATA_TYPE_BFLOAT16;
+        case DataType::Int16: return ONNX_TENSOR_ELEMENT_DATA_TYPE_INT16;
+        case DataType::Int8: return ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8;
+        default: return ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8;
+    }
+}
+
+static DataType from_ort_type(ONNXTensorElementDataType type) {
+    switch (type) {
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT: return DataType::Float32;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32: return DataType::Int32;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64: return DataType::Int64;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16: return DataType::Float16;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_BFLOAT16: return DataType::BFloat16;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT16: return DataType::Int16;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8: return DataType::Int8;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8: return DataType::UInt8;
+        default: throw std::runtime_error("unsupported onnxruntime datatype");
+    }
+}
+
+// cpu tensor, map is a plain pointer
+class OrtTensor : public Tensor {
+public:
+    OrtTensor(Ort::Value value) : value_(std::move(value)) {
+        auto info = value_.GetTensorTypeAndShapeInfo();
+        dtype_ = from_ort_type(info.GetElementType());
+        auto shape = info.GetShape();
+        shape_.assign(shape.begin(), shape.end());
+    }
+    virtual void* map(MapAccess access) override {
+        return value_.GetTensorMutableData<uint8_t>();
+    }
+    virtual void unmap() override {}
+    const Ort::Value& value() const { return value_; }
+private:
+    Ort::Value value_;
+};
+
+class OrtModule : public Module {
+public:
+    OrtModule(std::shared_ptr<Ort::RuntimeManager> runtime, const std::string& path, bool profile)
+        : runtime_(runtime), module_(runtime, path), profile_(profile) {
+        weight_size_ = std::filesystem::file_size(path);
+        auto weight_path = path + ".data";
+        if (std::filesystem::exists(weight_path)) {
+            weight_size_ += std::filesystem::file_size(weight_path);
+        }
+    }
+    virtual std::vector<TensorPtr> forward(const std::vector<TensorPtr>& inputs) override {
+        std::vector<const Ort::Value*> values;
+        for (auto& input : inputs) {
+            values.push_back(&static_cast<OrtTensor*>(input.get())->value());
+        }
+        // ort can't read and write one buffer in a run, so present goes to a pooled kv buffer
+        // held by nobody else; the past input and kv forked by other branches or swapped out
+        // sequences keep a reference and are never overwritten. Once the pool is used up,
+        // or for a past of another shape (batched kv), present is runtime allocated
+        TensorPtr present;
+        if (!kv_shape_.empty() && inputs.back()->shape() == kv_shape_) {
+            for (auto& kv : kv_cache_) {
+                if (kv.use_count() == 1) {
+                    present = kv;
+                    break;
+                }
+            }
+            if (!present && static_cast<int>(kv_cache_.size()) < kv_buffers_) {
+                present = create_kv();
+                kv_cache_.push_back(present);
+            }
+        }
+        auto outputs = module_.onForward(values, present ? &static_cast<OrtTensor*>(present.get())->value() : nullptr);
+        std::vector<TensorPtr> results;
+        for (size_t i = 0; i < outputs.size(); i++) {
+            if (present && i + 1 == outputs.size()) {
+                results.push_back(present);
+            } else {
+                results.emplace_back(new OrtTensor(std::move(outputs[i])));
+            }
+        }
+        return results;
+    }
+    virtual void bind_kv_cache(const std::vector<int>& shape, int buffers) override {
+        kv_shape_ = shape;
+        kv_buffers_ = std::max(buffers, 2);
+        kv_cache_.clear();
+        // ping-pong between past and present, more buffers are created on demand up to the cap
+        for (int i = 0; i < 2; i++) {
+            kv_cache_.push_back(create_kv());
+        }
+    }
+    virtual size_t weight_size() const override { return weight_size_; }
+    virtual std::vector<OpProfile> profile() override {
+        if (!profile_) {
+            return {};
+        }
+        // ort trace: a chrome trace event array, kernel time of a node is `{node}_kernel_time`
+        profile_ = false;
+        auto path = module_.end_profile();
+        std::ifstream ifs(path);
+        auto events = json::parse(ifs, nullptr, false);
+        if (!events.is_array()) {
+            printf("Failed: can't parse profile %s\n", path.c_str());
+            return {};
+        }
+        const std::string suffix = "_kernel_time";
+        std::map<std::string, OpProfile> ops;
+        for (auto& event : events) {
+            auto name = event.value("name", "");
+            if (event.value("cat", "") != "Node" || name.size() <= suffix.size() ||
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+                continue;
+            }
+            name = layer_pattern(name.substr(0, name.size() - suffix.size()));
+            auto& op = ops[name];
+            op.name = name;
+            if (event.contains("args")) {
+                op.type = event["args"].value("op_name", "");
+            }
+            op.count++;
+            op.us += event.value("dur", int64_t(0));
+        }
+        printf("ort profile is saved to %s\n", path.c_str());
+        std::vector<OpProfile> results;
+        for (auto& op : ops) {
+            results.push_back(op.second);
+        }
+        return results;
+    }
+private:
+    TensorPtr create_kv() {
+        std::vector<int64_t> shape_int64(kv_shape_.begin(), kv_shape_.end());
+        auto value = Ort::Value::CreateTensor<float>(runtime_->allocator(), shape_int64.data(), shape_int64.size());
+        TensorPtr kv(new OrtTensor(std::move(value)));
+        ::memset(kv->map(MAP_WRITE), 0, kv->bytes());
+        return kv;
+    }
+    std::shared_ptr<Ort::RuntimeManager> runtime_;
+    Ort::Module module_;
+    size_t weight_size_ = 0;
+    bool profile_ = false;
+    std::vector<int> kv_shape_;
+    int kv_buffers_ = 2;
+    std::vector<TensorPtr> kv_cache_;
+};
+
+class OrtBackend : public Backend {
+public:
+    OrtBackend(const BackendOptions& options) {
+        Ort::RuntimeOptions runtime_options;
+        runtime_options.intra_threads = options.intra_threads;
+        runtime_options.inter_threads = options.inter_threads;
+        runtime_options.thread_affinity = options.thread_affinity;
+        runtime_options.allow_spinning = options.allow_spinning;
+        const GraphOptimizationLevel levels[] = {
+            GraphOptimizationLevel::ORT_DISABLE_ALL, GraphOptimizationLevel::ORT_ENABLE_BASIC,
+            GraphOptimizationLevel::ORT_ENABLE_EXTENDED, GraphOptimizationLevel::ORT_ENABLE_ALL
+        };
+        runtime_options.optimization_level = levels[std::min(std::max(options.optimization_level, 0), 3)];
+        runtime_options.memory_arena = options.memory_arena;
+        runtime_options.memory_pattern = options.memory_pattern;
+        runtime_options.optimized_model_path = options.optimized_model_path;
+        runtime_options.profile = options.profile;
+        runtime_options.profile_prefix = options.profile_prefix;
+        profile_ = options.profile;
+        runtime_.reset(new Ort::RuntimeManager(runtime_options));
+    }
+    virtual std::string name() const override { return "ort"; }
+    virtual TensorPtr create_tensor(DataType dtype, const std::vector<int>& shape) override {
+        std::vector<int64_t> shape_int64(shape.begin(), shape.end());
+        auto value = Ort::Value::CreateTensor(runtime_->allocator(), shape_int64.data(), shape_int64.size(), to_ort_type(dtype));
+        return std::make_shared<OrtTensor>(std::move(value));
+    }
+    virtual std::shared_ptr<Module> load(const std::string& path) override {
+        return std::make_shared<OrtModule>(runtime_, path, profile_);
+    }
+private:
+    std::shared_ptr<Ort::RuntimeManager> runtime_;
+    bool profile_ = false;
+};
+
+Backend* createOrtBackend(const BackendOptions& options) {
+    return new OrtBackend(options);
+}
+
+#endif // LLM_BACKEND_ORT
@@ -0,0 +1,261 @@
+//
+//  scheduler.cpp
+//
+//  Iteration level scheduling of concurrent requests on one Llm.
+//
+
+#include <chrono>
+#include <algorithm>
+
+#include "scheduler.hpp"
+#include "llmconfig.hpp"
+#include "tokenizer.hpp"
+
+static int64_t elapsed_us(std::chrono::steady_clock::time_point st) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - st).count();
+}
+
+Scheduler::Scheduler(Llm* llm, int max_running) : llm_(llm), max_running_(max_running) {
+    batched_ = llm_->batch_enabled();
+    if (batched_) {
+        // every running sequence owns one slot of the batched kv cache
+        max_running_ = llm_->config_->max_batch();
+        batch_kv_ = llm_->new_kv_cache(max_running_);
+        slots_.resize(max_running_);
+    }
+    max_running_ = std::max(max_running_, 1);
+    if (!batched_ && llm_->config_->io_binding()) {
+        // every swapped out sequence holds its kv, plus the present of the running one
+        llm_->module_->bind_kv_cache(llm_->key_value_shape_, max_running_ + 1);
+    }
+}
+
+Scheduler::~Scheduler() {
+    stop();
+}
+
+int Scheduler::submit(const std::vector<int>& input_ids, int max_new_tokens, TokenCallback on_token, FinishCallback on_finish) {
+    auto seq = std::make_shared<Sequence>();
+    seq->input_ids = input_ids;
+    seq->max_new_tokens = max_new_tokens > 0 ? max_new_tokens : llm_->config_->max_new_tokens();
+    seq->on_token = std::move(on_token);
+    seq->on_finish = std::move(on_finish);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        seq->id = next_id_++;
+        waiting_.push_back(seq);
+    }
+    cv_.notify_one();
+    return seq->id;
+}
+
+int Scheduler::submit(const std::string& prompt, int max_new_tokens, TokenCallback on_token, FinishCallback on_finish) {
+    return submit(llm_->tokenizer(prompt), max_new_tokens, std::move(on_token), std::move(on_finish));
+}
+
+size_t Scheduler::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waiting_.size() + running_.size();
+}
+
+void Scheduler::swap_in(Sequence& seq) {
+    llm_->past_key_values_ = std::move(seq.past_key_values);
+    llm_->all_seq_len_ = seq.all_seq_len;
+    llm_->evicted_len_ = seq.evicted_len;
+    llm_->gen_seq_len_ = seq.gen_seq_len;
+}
+
+void Scheduler::swap_out(Sequence& seq) {
+    seq.past_key_values = std::move(llm_->past_key_values_);
+    seq.all_seq_len = llm_->all_seq_len_;
+    seq.evicted_len = llm_->evicted_len_;
+    seq.gen_seq_len = llm_->gen_seq_len_;
+}
+
+void Scheduler::admit() {
+    std::vector<SequencePtr> refused;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!waiting_.empty() && static_cast<int>(running_.size()) < max_running_) {
+            auto seq = waiting_.front();
+            waiting_.pop_front();
+            // the llm still counts the last swapped out sequence, the room is that of an empty kv cache
+            swap_in(*seq);
+            bool fit = !seq->input_ids.empty() && llm_->fit_context(seq->input_ids);
+            swap_out(*seq);
+            if (!fit) {
+                refused.push_back(seq);
+                continue;
+            }
+            if (batched_) {
+                auto slot = std::find(slots_.begin(), slots_.end(), nullptr);
+                seq->slot = static_cast<int>(slot - slots_.begin());
+                *slot = seq;
+            }
+            // prefill runs on a batch 1 kv cache, batched mode copies it into the slot afterwards
+            seq->past_key_values = llm_->new_kv_cache();
+            seq->ids = seq->input_ids;
+            running_.push_back(seq);
+        }
+    }
+    // callbacks may submit, they run without the lock
+    for (auto& seq : refused) {
+        if (seq->on_finish) {
+            seq->on_finish("");
+        }
+    }
+}
+
+void Scheduler::finish(Sequence& seq) {
+    seq.done = true;
+    seq.past_key_values.reset();
+    if (seq.slot >= 0) {
+        slots_[seq.slot].reset();
+        seq.slot = -1;
+    }
+    if (seq.on_finish) {
+        seq.on_finish(seq.text);
+    }
+}
+
+bool Scheduler::accept(Sequence& seq, int token) {
+    seq.token = token;
+    if (llm_->is_stop(seq.token)) {
+        finish(seq);
+        return false;
+    }
+    auto word = llm_->decode(seq.token);
+    seq.text += word;
+    seq.generated++;
+    bool go_on = !seq.on_token || seq.on_token(seq.token, word);
+    // batched kv has no streaming eviction, a slot ends at the kv capacity
+    int context = batched_ ? llm_->kv_capacity_ : llm_->max_context_;
+    bool context_full = context > 0 && seq.all_seq_len >= context && (batched_ || !llm_->config_->streaming_kv());
+    if (!go_on || seq.generated >= seq.max_new_tokens || context_full) {
+        finish(seq);
+        return false;
+    }
+    return true;
+}
+
+void Scheduler::prefill(Sequence& seq) {
+    auto st = std::chrono::steady_clock::now();
+    swap_in(seq);
+    int pos = seq.prefill_pos;
+    auto logits = llm_->prefill_step(seq.input_ids, pos);
+    swap_out(seq);
+    stats_.prefill_tokens += pos - seq.prefill_pos;
+    seq.prefill_pos = pos;
+    if (seq.prefill_pos == static_cast<int>(seq.input_ids.size())) {
+        if (batched_) {
+            llm_->copy_kv_slot(seq.past_key_values, batch_kv_, seq.slot);
+            seq.past_key_values.reset();
+        }
+        // a static prefill function may return logits of every position, the last row is sampled
+        accept(seq, llm_->sample(logits, seq.ids));
+    }
+    stats_.prefill_us += elapsed_us(st);
+}
+
+void Scheduler::decode_round_robin() {
+    auto st = std::chrono::steady_clock::now();
+    for (auto& seq : running_) {
+        if (seq->done || seq->prefill_pos < static_cast<int>(seq->input_ids.size())) {
+            continue;
+        }
+        swap_in(*seq);
+        seq->ids.push_back(seq->token);
+        auto logits = llm_->forward({seq->token});
+        swap_out(*seq);
+        accept(*seq, llm_->sample(logits, seq->ids));
+        stats_.decode_tokens++;
+    }
+    stats_.decode_us += elapsed_us(st);
+}
+
+void Scheduler::decode_batch() {
+    std::vector<int> tokens(max_running_, 0), positions(max_running_, -1);
+    std::vector<SequencePtr> batch(max_running_);
+    bool any = false;
+    for (int b = 0; b < max_running_; b++) {
+        auto seq = slots_[b];
+        if (!seq || seq->done || seq->prefill_pos < static_cast<int>(seq->input_ids.size())) {
+            continue;
+        }
+        tokens[b] = seq->token;
+        positions[b] = seq->all_seq_len + seq->evicted_len;
+        seq->ids.push_back(seq->token);
+        batch[b] = seq;
+        any = true;
+    }
+    if (!any) {
+        return;
+    }
+    auto st = std::chrono::steady_clock::now();
+    auto logits = llm_->forward_batch(tokens, positions, batch_kv_);
+    auto scores = logits->map<float>(MAP_READ_WRITE);
+    int vocab = logits->shape().back();
+    for (int b = 0; b < max_running_; b++) {
+        if (batch[b]) {
+            batch[b]->all_seq_len++;
+            accept(*batch[b], llm_->sample(scores + b * vocab, vocab, batch[b]->ids));
+            stats_.decode_tokens++;
+        }
+    }
+    logits->unmap();
+    stats_.decode_us += elapsed_us(st);
+}
+
+bool Scheduler::step() {
+    admit();
+    if (running_.empty()) {
+        return false;
+    }
+    stats_.steps++;
+    // one prefill chunk per step, decode latency of running sequences is bounded by `prefill_chunk`
+    for (auto& seq : running_) {
+        if (!seq->done && seq->prefill_pos < static_cast<int>(seq->input_ids.size())) {
+            prefill(*seq);
+            break;
+        }
+    }
+    if (batched_) {
+        decode_batch();
+    } else {
+        decode_round_robin();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_.erase(std::remove_if(running_.begin(), running_.end(), [](const SequencePtr& seq) { return seq->done; }),
+                   running_.end());
+    return true;
+}
+
+void Scheduler::run_until_idle() {
+    while (step()) {}
+}
+
+void Scheduler::start() {
+    if (worker_.joinable()) {
+        return;
+    }
+    stop_ = false;
+    worker_ = std::thread([this]() {
+        while (!stop_) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stop_ || !waiting_.empty() || !running_.empty(); });
+            }
+            if (!stop_) {
+                step();
+            }
+        }
+    });
+}
+
+void Scheduler::stop() {
+    stop_ = true;
+    cv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
@@ -15,6 +15,7 @@
 #include <regex>
 #include <set>
 #include <climits>
+#include <type_traits>
 
 // base64
 static const std::string base64_chars =
@@ -78,6 +79,42 @@ static inline void to_lower_case(std::string& str) {
     }
 }
 
+// approximate heap bytes of containers, used by memory accounting
+template <typename T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+static inline size_t heap_bytes(const T&) { return 0; }
+
+static inline size_t heap_bytes(const std::string& str) {
+    return str.capacity() > 15 ? str.capacity() + 1 : 0;
+}
+
+static inline size_t heap_bytes(const std::wstring& str) {
+    return str.capacity() > 3 ? (str.capacity() + 1) * sizeof(wchar_t) : 0;
+}
+
+template <typename K, typename V>
+static inline size_t heap_bytes(const std::pair<K, V>& pair) {
+    return heap_bytes(pair.first) + heap_bytes(pair.second);
+}
+
+template <typename T>
+static inline size_t heap_bytes(const std::vector<T>& vec) {
+    size_t bytes = vec.capacity() * sizeof(T);
+    for (const auto& item : vec) {
+        bytes += heap_bytes(item);
+    }
+    return bytes;
+}
+
+template <typename K, typename V, typename H>
+static inline size_t heap_bytes(const std::unordered_map<K, V, H>& map) {
+    // buckets + nodes (value and next pointer and cached hash)
+    size_t bytes = map.bucket_count() * sizeof(void*) + map.size() * (sizeof(std::pair<const K, V>) + 2 * sizeof(void*));
+    for (const auto& item : map) {
+        bytes += heap_bytes(item.first) + heap_bytes(item.second);
+    }
+    return bytes;
+}
+
 Tokenizer* Tokenizer::createTokenizer(const std::string& filename) {
     Tokenizer* tokenizer = nullptr;
     // check file
@@ -97,7 +134,6 @@ Tokenizer* Tokenizer::createTokenizer(const std::string& filename) {
         return tokenizer;
     }
     line_str >> tokenizer_type;
-    printf("tokenizer_type = %d\n", tokenizer_type);
     // create tokenizer
     switch (tokenizer_type)
     {
@@ -163,8 +199,15 @@ void Tokenizer::load_special(std::ifstream& tok_file) {
     }
 }
 
-std::vector<int> Tokenizer::encode(const std::string& str) {
-    std::vector<int> ids = prefix_tokens_;
+size_t Tokenizer::memory_usage() const {
+    return heap_bytes(special_tokens_) + heap_bytes(stop_tokens_) + heap_bytes(prefix_tokens_);
+}
+
+std::vector<int> Tokenizer::encode(const std::string& str, bool with_prefix) {
+    std::vector<int> ids;
+    if (with_prefix) {
+        ids = prefix_tokens_;
+    }
     if (!special_tokens_.empty()) {
         std::string text = str;
         size_t start = 0;
@@ -407,7 +450,18 @@ void Sentencepiece::encode(const std::string& str, std::vector<int>& ids) {
     }
 }
 
+size_t Sentencepiece::memory_usage() const {
+    size_t bytes = Tokenizer::memory_usage() + sentence_pieces_.capacity() * sizeof(SentencePiece);
+    for (const auto& piece : sentence_pieces_) {
+        bytes += heap_bytes(piece.piece);
+    }
+    return bytes + heap_bytes(pieces_) + heap_bytes(reserved_id_map_);
+}
+
 std::string Sentencepiece::decode(int id) {
+    if (id < 0 || id >= static_cast<int>(sentence_pieces_.size())) {
+        return "";
+    }
     auto piece = sentence_pieces_[id].piece;
     int pos = piece.find("▁");
     if (pos != -1) {
@@ -416,6 +470,24 @@ std::string Sentencepiece::decode(int id) {
     return piece;
 }
 
+void Sentencepiece::decode_append(int id, std::string& out) {
+    if (id < 0 || id >= static_cast<int>(sentence_pieces_.size())) {
+        return;
+    }
+    const auto& piece = sentence_pieces_[id].piece;
+    size_t pos = piece.find("▁");
+    if (pos == std::string::npos) {
+        out += piece;
+        return;
+    }
+    // same as decode: the replaced length is pos + 3
+    out.append(piece, 0, pos);
+    out += ' ';
+    if (2 * pos + 3 < piece.size()) {
+        out.append(piece, 2 * pos + 3, std::string::npos);
+    }
+}
+
 float Sentencepiece::get_score(int id) const {
     return sentence_pieces_[id].score;
 }
@@ -478,6 +550,10 @@ void Tiktoken::encode(const std::string& str, std::vector<int>& ids) {
     }
 }
 
+size_t Tiktoken::memory_usage() const {
+    return Tokenizer::memory_usage() + heap_bytes(encoder_) + heap_bytes(decoder_);
+}
+
 std::string Tiktoken::decode(int id) {
     if (id >= decoder_.size()) {
         return "";
@@ -485,6 +561,12 @@ std::string Tiktoken::decode(int id) {
     return decoder_[id];
 }
 
+void Tiktoken::decode_append(int id, std::string& out) {
+    if (id < decoder_.size()) {
+        out += decoder_[id];
+    }
+}
+
 std::vector<int> BertTokenizer::word_piece(const std::string& token) {
     auto it = encoder_.find(token);
     if (it != encoder_.end()) {
@@ -733,6 +815,32 @@ void HuggingfaceTokenizer::encode(const std::string& str, std::vector<int>& ids)
     }
 }
 
+size_t HuggingfaceTokenizer::memory_usage() const {
+    return Tokenizer::memory_usage() + heap_bytes(bpe_ranks_) + heap_bytes(b2u_) + heap_bytes(u2b_) +
+           heap_bytes(encoder_) + heap_bytes(decoder_);
+}
+
+void HuggingfaceTokenizer::decode_append(int id, std::string& out) {
+    if (id >= decoder_.size()) {
+        return;
+    }
+    // walk the utf-8 code points in place instead of a wstring copy
+    const auto& token = decoder_[id];
+    for (size_t i = 0; i < token.size();) {
+        unsigned char c = token[i];
+        int len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : 4;
+        wchar_t code = len == 1 ? c : c & (0x3f >> (len - 1));
+        for (int j = 1; j < len && i + j < token.size(); j++) {
+            code = (code << 6) | (token[i + j] & 0x3f);
+        }
+        i += len;
+        auto iter = u2b_.find(code);
+        if (iter != u2b_.end()) {
+            out.push_back(char(iter->second));
+        }
+    }
+}
+
 std::string HuggingfaceTokenizer::decode(int id) {
     // printf("decode id = %d, %lu, %s#\n", id, decoder_.size(), decoder_.at(id).c_str());
     if (id >= decoder_.size()) {
@@ -0,0 +1,153 @@
+//
+//  trace.cpp
+//
+//  Per-request, per-token timing trace of the host path.
+//
+
+#include <fstream>
+#include <algorithm>
+
+#include "trace.hpp"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+const char* trace_stage_name(TraceStage stage) {
+    switch (stage) {
+        case TraceStage::Tokenize: return "tokenize";
+        case TraceStage::Prefill: return "prefill";
+        case TraceStage::Decode: return "decode";
+        case TraceStage::Embedding: return "embedding";
+        case TraceStage::Mask: return "mask";
+        case TraceStage::Position: return "position";
+        case TraceStage::Invoke: return "invoke";
+        case TraceStage::Sample: return "sample";
+        case TraceStage::Detokenize: return "detokenize";
+        default: return "unknown";
+    }
+}
+
+Tracer::Tracer(size_t capacity) : epoch_(std::chrono::steady_clock::now()), capacity_(std::max<size_t>(capacity, 1)) {}
+
+void Tracer::enable(bool enabled) {
+    if (enabled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ring_.empty()) {
+            ring_.resize(capacity_);
+        }
+    }
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void Tracer::set_capacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = std::max<size_t>(capacity, 1);
+    // a tracer that was never enabled keeps no ring
+    if (!ring_.empty()) {
+        ring_.assign(capacity_, TraceEvent());
+    }
+    head_ = 0;
+    size_ = 0;
+}
+
+void Tracer::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    head_ = 0;
+    size_ = 0;
+}
+
+void Tracer::record(TraceStage stage, int64_t start_us, int64_t dur_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ring_.empty()) {
+        return;
+    }
+    auto& event = ring_[head_];
+    event.request = request_;
+    event.token = token_;
+    event.stage = stage;
+    event.start_us = start_us;
+    event.dur_us = dur_us;
+    head_ = (head_ + 1) % ring_.size();
+    size_ = std::min(size_ + 1, ring_.size());
+}
+
+std::vector<TraceEvent> Tracer::events() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<TraceEvent> events;
+    events.reserve(size_);
+    if (ring_.empty()) {
+        return events;
+    }
+    size_t first = (head_ + ring_.size() - size_) % ring_.size();
+    for (size_t i = 0; i < size_; i++) {
+        events.push_back(ring_[(first + i) % ring_.size()]);
+    }
+    // scopes are recorded when they end, nested ones come first; order by start, enclosing first
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+        return a.start_us < b.start_us || (a.start_us == b.start_us && a.dur_us > b.dur_us);
+    });
+    return events;
+}
+
+std::vector<int64_t> Tracer::stage_us(int64_t request) const {
+    std::vector<int64_t> totals(static_cast<int>(TraceStage::Count), 0);
+    for (auto& event : events()) {
+        if (request <= 0 || event.request == request) {
+            totals[static_cast<int>(event.stage)] += event.dur_us;
+        }
+    }
+    return totals;
+}
+
+static json event_json(const TraceEvent& event) {
+    return {
+        {"request", event.request},
+        {"token", event.token},
+        {"stage", trace_stage_name(event.stage)},
+        {"start_us", event.start_us},
+        {"dur_us", event.dur_us}
+    };
+}
+
+std::string Tracer::to_json() const {
+    json output = json::array();
+    for (auto& event : events()) {
+        output.push_back(event_json(event));
+    }
+    return output.dump();
+}
+
+std::string Tracer::to_chrome_trace() const {
+    json trace_events = json::array();
+    for (auto& event : events()) {
+        trace_events.push_back({
+            {"name", trace_stage_name(event.stage)},
+            {"cat", "llm"},
+            {"ph", "X"},
+            {"ts", event.start_us},
+            {"dur", event.dur_us},
+            {"pid", 0},
+            {"tid", event.request},
+            {"args", {{"token", event.token}}}
+        });
+    }
+    json output = {{"traceEvents", trace_events}, {"displayTimeUnit", "ms"}};
+    return output.dump();
+}
+
+bool Tracer::save(const std::string& path) const {
+    std::ofstream ofs(path);
+    if (!ofs.is_open()) {
+        printf("Failed: can't open trace file %s\n", path.c_str());
+        return false;
+    }
+    const std::string jsonl = ".jsonl";
+    if (path.size() >= jsonl.size() && path.compare(path.size() - jsonl.size(), jsonl.size(), jsonl) == 0) {
+        for (auto& event : events()) {
+            ofs << event_json(event).dump() << "\n";
+        }
+    } else {
+        ofs << to_chrome_trace();
+    }
+    return ofs.good();
+}
@@ -0,0 +1,299 @@
+//
+//  llm_test.cpp
+//
+//  Generation paths on the mock backend with a generated tokenizer and embedding table: no model files,
+//  every check compares outputs that must be equal, a broken kv length, rollback or eviction changes them.
+//
+
+#include "llm.hpp"
+#include "scheduler.hpp"
+#include "mock_model.hpp"
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("Failed: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static const int vocab_size = 1024;
+static const int hidden_size = 64;
+static std::string dir;
+
+// bf16 rows of random bits, the mock hashes the first values of a row
+static void write_embedding(const std::string& path, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint16_t> table(static_cast<size_t>(vocab_size) * hidden_size);
+    for (auto& value : table) {
+        value = static_cast<uint16_t>(rng());
+    }
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(uint16_t));
+}
+
+// config.json of the mock model patched by `extra`, a new instance reads kv shape and seed again
+static std::unique_ptr<Llm> create_llm(const json& extra = json::object()) {
+    static int count = 0;
+    json config = {
+        {"backend_type", "mock"},
+        {"mock_vocab_size", vocab_size},
+        {"max_new_tokens", 64},
+        {"temperature", 0.f},
+        {"seed", 0}
+    };
+    config.merge_patch(extra);
+    auto path = dir + "/config_" + std::to_string(count++) + ".json";
+    std::ofstream(path) << config.dump();
+    std::unique_ptr<Llm> llm(Llm::createLLM(path));
+    llm->load();
+    return llm;
+}
+
+static std::vector<int> concat(std::vector<int> a, const std::vector<int>& b) {
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+static GenerationResult generate(Llm* llm, const std::vector<int>& input_ids, int max_new_tokens) {
+    GenerationControl control;
+    control.max_new_tokens = max_new_tokens;
+    llm->generate_init();
+    return llm->generate(input_ids, control);
+}
+
+static void test_generate() {
+    auto llm = create_llm();
+    auto prompt = llm->tokenizer("the quick brown fox jumps over the lazy dog");
+    auto ids = llm->generate(prompt, 24);
+    CHECK(!ids.empty());
+    CHECK(llm->generate(prompt, 24) == ids);
+    CHECK(create_llm()->generate(prompt, 24) == ids);
+    // chunked prefill appends to the same kv rows at the same positions
+    auto chunked = create_llm({{"prefill_chunk", 5}});
+    CHECK(chunked->generate(prompt, 24) == ids);
+    auto result = generate(llm.get(), prompt, 24);
+    CHECK(result.ids == ids);
+    CHECK(result.prompt_tokens == static_cast<int>(prompt.size()));
+}
+
+static void test_kv_reuse() {
+    auto llm = create_llm({{"reuse_kv", true}});
+    auto first = llm->tokenizer("first question");
+    auto second = llm->tokenizer("second question");
+    auto output = llm->generate(first, 16);
+    CHECK(!output.empty());
+    // the last sampled token is not forwarded, the kv cache holds the prompt and the rest
+    auto context = concat(first, output);
+    context.resize(llm->all_seq_len_);
+    auto session = dir + "/session.bin";
+    CHECK(llm->save_session(session));
+    auto reused = llm->generate(second, 16);
+    auto fresh = create_llm();
+    CHECK(fresh->generate(concat(context, second), 16) == reused);
+    // a restored session continues like the context it was saved from
+    auto restored = create_llm({{"reuse_kv", true}});
+    CHECK(restored->load_session(session));
+    CHECK(restored->all_seq_len_ == static_cast<int>(context.size()));
+    CHECK(restored->generate(second, 16) == reused);
+    // rolled back entries are not attended by the next turn
+    auto rolled = create_llm({{"reuse_kv", true}});
+    rolled->generate(first, 16);
+    rolled->rollback(3);
+    auto shorter = std::vector<int>(context.begin(), context.end() - 3);
+    CHECK(rolled->all_seq_len_ == static_cast<int>(shorter.size()));
+    CHECK(rolled->generate(second, 16) == fresh->generate(concat(shorter, second), 16));
+}
+
+static void test_conversation() {
+    auto llm = create_llm({{"max_new_tokens", 48}});
+    auto other = create_llm({{"max_new_tokens", 48}});
+    Conversation conversation(llm.get()), replay(other.get());
+    std::ostringstream os;
+    const std::vector<std::string> turns = {"hello there", "what did i say", "and before that"};
+    for (size_t i = 0; i < turns.size(); i++) {
+        auto answer = conversation.response(turns[i], &os);
+        CHECK(replay.response(turns[i], &os) == answer);
+        if (i > 0) {
+            // a continued turn only prefills its delta on top of the kv cache
+            auto delta = llm->encode(llm->turn_end() + llm->apply_chat_template({{"user", turns[i]}}), false);
+            CHECK(llm->prompt_len_ == static_cast<int>(delta.size()));
+        }
+    }
+    CHECK(conversation.history().size() == 1 + 2 * turns.size());
+    // a small context drops the oldest turns and prefills the rest again
+    auto small = create_llm({{"max_new_tokens", 16}, {"max_context", 96}});
+    Conversation sliding(small.get());
+    for (int i = 0; i < 6; i++) {
+        sliding.response("tell me something new number " + std::to_string(i), &os);
+        CHECK(small->all_seq_len_ <= 96);
+    }
+    CHECK(sliding.history().size() < 1 + 2 * 6);
+}
+
+// key rows of the first kv slice in a session file, the mock writes one per token at its kv row
+static std::vector<uint32_t> session_keys(const std::string& path) {
+    std::ifstream ifs(path, std::ios::binary);
+    uint32_t magic = 0;
+    int header[4] = {0};
+    ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    ifs.read(reinterpret_cast<char*>(header), sizeof(header));
+    std::vector<int> history(header[2]), shape(header[3]);
+    ifs.read(reinterpret_cast<char*>(history.data()), history.size() * sizeof(int));
+    ifs.read(reinterpret_cast<char*>(shape.data()), shape.size() * sizeof(int));
+    // [layers, 2, heads, seq, head dim]
+    int capacity = shape[3], row = shape[4];
+    std::vector<uint32_t> kv(static_cast<size_t>(capacity) * row);
+    ifs.read(reinterpret_cast<char*>(kv.data()), kv.size() * sizeof(uint32_t));
+    std::vector<uint32_t> keys;
+    for (int i = 0; i < header[0]; i++) {
+        keys.push_back(kv[i * row]);
+    }
+    return keys;
+}
+
+static void test_streaming() {
+    json streaming = {{"max_context", 48}, {"streaming_kv", true}, {"attention_sink", 4}};
+    auto llm = create_llm(streaming);
+    auto prompt = llm->tokenizer("stream");
+    auto result = generate(llm.get(), prompt, 150);
+    // far past the context, the middle is evicted
+    CHECK(result.finish_reason == FinishReason::Length);
+    CHECK(result.ids.size() == 150);
+    CHECK(llm->all_seq_len_ <= 48);
+    CHECK(generate(create_llm(streaming).get(), prompt, 150).ids == result.ids);
+    // nothing is evicted while the context fits, streaming decodes like a plain kv cache
+    auto roomy = create_llm({{"streaming_kv", true}});
+    CHECK(generate(roomy.get(), prompt, 40).ids == generate(create_llm().get(), prompt, 40).ids);
+    // a prompt longer than the context is prefilled in chunks that fit next to the sink
+    std::string text;
+    for (int i = 0; i < 20; i++) {
+        text += "a long prompt ";
+    }
+    auto long_prompt = llm->tokenizer(text);
+    CHECK(static_cast<int>(long_prompt.size()) > 48);
+    auto long_result = generate(llm.get(), long_prompt, 8);
+    CHECK(!long_result.ids.empty());
+    CHECK(llm->all_seq_len_ <= 48);
+    // keys carry absolute positions, after eviction the kv holds the sink and the latest tokens of the stream
+    auto absolute = create_llm({{"max_context", 48}, {"streaming_kv", true}, {"attention_sink", 4},
+                                {"streaming_position", "absolute"}, {"prefill_chunk", 7}});
+    // within the capacity of the model without eviction
+    std::vector<int> stream(long_prompt.begin(), long_prompt.begin() + std::min<size_t>(long_prompt.size(), 200));
+    absolute->generate_init();
+    absolute->prefill(stream);
+    CHECK(absolute->save_session(dir + "/streaming.bin"));
+    auto whole = create_llm();
+    whole->generate_init();
+    whole->prefill(stream);
+    CHECK(whole->save_session(dir + "/whole.bin"));
+    auto kept = session_keys(dir + "/streaming.bin");
+    auto all = session_keys(dir + "/whole.bin");
+    CHECK(kept.size() > 4 && kept.size() <= 48);
+    if (kept.size() > 4 && kept.size() <= all.size()) {
+        std::vector<uint32_t> expected(all.begin(), all.begin() + 4);
+        expected.insert(expected.end(), all.end() - (kept.size() - 4), all.end());
+        CHECK(kept == expected);
+    }
+}
+
+static void test_generate_n() {
+    const std::string prompt = "sample a few";
+    std::ostringstream os;
+    auto llm = create_llm();
+    auto greedy = llm->generate_n(prompt, 3);
+    CHECK(greedy.size() == 3);
+    CHECK(greedy[0] == greedy[1] && greedy[1] == greedy[2]);
+    CHECK(greedy[0] == llm->response(prompt, &os));
+    // branches sample with their own rng from one seed
+    json sampled = {{"temperature", 3.f}, {"seed", 42}};
+    auto sampler = create_llm(sampled);
+    auto outputs = sampler->generate_n(prompt, 4);
+    CHECK(outputs.size() == 4);
+    CHECK(create_llm(sampled)->generate_n(prompt, 4) == outputs);
+    CHECK(!(outputs[0] == outputs[1] && outputs[1] == outputs[2] && outputs[2] == outputs[3]));
+    // the first branch draws the same rng either way, siblings writing the shared prefix kv would change it
+    CHECK(create_llm(sampled)->generate_n(prompt, 1)[0] == outputs[0]);
+    // branches don't leave a context behind
+    CHECK(sampler->all_seq_len_ == 0);
+}
+
+static void test_speculative() {
+    const std::string prompt = "speculate on the next words of this sentence";
+    std::ostringstream os;
+    auto expected = create_llm()->response(prompt, &os);
+    // the same model as draft: every draft token is accepted
+    std::ofstream(dir + "/draft.json") << json({{"backend_type", "mock"}, {"mock_vocab_size", vocab_size}}).dump();
+    auto same = create_llm({{"draft_config", dir + "/draft.json"}});
+    CHECK(same->response(prompt, &os) == expected);
+    CHECK(same->speculative_stats().accepted > 0);
+    // another embedding table: most drafts are rejected and rolled back
+    std::ofstream(dir + "/draft_other.json") << json({{"backend_type", "mock"}, {"mock_vocab_size", vocab_size},
+                                                     {"embedding_file", "draft_embeddings_bf16.bin"}}).dump();
+    auto other = create_llm({{"draft_config", dir + "/draft_other.json"}});
+    CHECK(other->response(prompt, &os) == expected);
+    auto stats = other->speculative_stats();
+    CHECK(stats.proposed > stats.accepted);
+    // prompt lookup proposes from the context
+    auto lookup = create_llm({{"lookup_ngram", 1}});
+    CHECK(lookup->response(prompt, &os) == expected);
+}
+
+static void test_scheduler() {
+    auto llm = create_llm();
+    // long enough that a request admitted next to the length of a finished one would be cut
+    std::string padding;
+    for (int i = 0; i < 8; i++) {
+        padding += " with some padding";
+    }
+    const std::vector<std::string> prompts = {"first request" + padding, "a second one" + padding, "and the third" + padding};
+    std::vector<std::string> expected;
+    for (auto& prompt : prompts) {
+        expected.push_back(generate(llm.get(), llm->tokenizer(prompt), 20).text);
+    }
+    // more requests than running sequences, each is admitted on an empty kv cache
+    Scheduler scheduler(llm.get(), 2);
+    std::vector<std::string> texts(prompts.size());
+    for (size_t i = 0; i < prompts.size(); i++) {
+        scheduler.submit(prompts[i], 20, nullptr, [&texts, i](const std::string& text) { texts[i] = text; });
+    }
+    scheduler.run_until_idle();
+    CHECK(texts == expected);
+}
+
+int main() {
+    char dir_template[] = "/tmp/llm_test.XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        printf("Failed: can't create a temp directory\n");
+        return 1;
+    }
+    dir = dir_template;
+    write_tokenizer(dir + "/tokenizer.txt", vocab_size);
+    write_embedding(dir + "/embeddings_bf16.bin", 0);
+    write_embedding(dir + "/draft_embeddings_bf16.bin", 1);
+    std::ofstream(dir + "/llm_config.json") << json({
+        {"hidden_size", hidden_size},
+        {"layer_nums", 2},
+        {"key_value_shape", {2, 1, 256, 16}},
+        {"kv_seq_axis", 2},
+        {"prompt_template", "<user>%s</user>"},
+        {"chat_template", "<%r>%s</end>"}
+    }).dump();
+    test_generate();
+    test_kv_reuse();
+    test_conversation();
+    test_streaming();
+    test_generate_n();
+    test_speculative();
+    test_scheduler();
+    std::string command = "rm -rf " + dir;
+    if (system(command.c_str()) != 0) {
+        printf("Failed: can't remove %s\n", dir.c_str());
+    }
+    printf("%s: %d failed checks\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}